@@ -23,10 +23,16 @@
 #include <cmath>
 #include <cstddef>
 #include <cstdlib>
+#include <cstring>
 #include <iterator>
 #include <limits>
 #include <string>
 #include <vector>
+#include <stdint.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 
 static const std::size_t bits_per_char = 0x08;    // 8 bits in 1 char(unsigned)
@@ -724,6 +730,136 @@ private:
    std::vector<unsigned long long int> size_list;
 };
 
+/*
+  Split block bloom filter for 64-bit integer keys. Each key maps to one
+  32-byte block and sets one bit in each of its eight 32-bit words, so a
+  query touches a single cache line and the eight probes are independent
+  lanes (one AVX2 multiply/shift when available).
+
+  insert() and contains() may run concurrently: bits are set with atomic
+  ORs, and a reader racing an insert can only miss the key being inserted.
+  clear() is meant for the single writer once nothing it inserted needs to
+  be found any more.
+*/
+class blocked_bloom_filter
+{
+public:
+
+   blocked_bloom_filter(const std::size_t projected_element_count = 8192)
+   {
+      // About 16 bits per key, rounded up to a power of two blocks.
+      block_count_ = 1;
+      while ((block_count_ * 16) < projected_element_count)
+      {
+         block_count_ <<= 1;
+      }
+
+      void* table = 0;
+      if (0 != posix_memalign(&table, 64, block_count_ * sizeof(block_type)))
+         table = 0;
+      table_ = reinterpret_cast<block_type*>(table);
+      std::memset(table_, 0x00, block_count_ * sizeof(block_type));
+   }
+
+   ~blocked_bloom_filter()
+   {
+      free(table_);
+   }
+
+   // Word by word with atomic stores, so readers may query meanwhile; they
+   // see each word either before or after it is cleared.
+   inline void clear()
+   {
+      uint32_t* word = reinterpret_cast<uint32_t*>(table_);
+
+      for (std::size_t i = 0; i < block_count_ * words_per_block; ++i)
+      {
+         __atomic_store_n(&word[i], 0U, __ATOMIC_RELAXED);
+      }
+   }
+
+   inline void insert(const int64_t key)
+   {
+      uint32_t* block;
+      uint32_t mask[words_per_block];
+
+      compute_mask(key, block, mask);
+
+      for (std::size_t i = 0; i < words_per_block; ++i)
+      {
+         if ((__atomic_load_n(&block[i], __ATOMIC_RELAXED) & mask[i]) != mask[i])
+            __atomic_fetch_or(&block[i], mask[i], __ATOMIC_RELAXED);
+      }
+   }
+
+   inline bool contains(const int64_t key) const
+   {
+      uint32_t* block;
+      uint32_t mask[words_per_block];
+
+      compute_mask(key, block, mask);
+
+      #ifdef __AVX2__
+      __m256i m = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(mask));
+      __m256i b = _mm256_load_si256(reinterpret_cast<const __m256i*>(block));
+      return _mm256_testc_si256(b, m);
+      #else
+      uint32_t missing = 0;
+      for (std::size_t i = 0; i < words_per_block; ++i)
+      {
+         missing |= mask[i] & ~__atomic_load_n(&block[i], __ATOMIC_RELAXED);
+      }
+      return (0 == missing);
+      #endif
+   }
+
+   inline std::size_t size() const
+   {
+      return block_count_ * sizeof(block_type) * bits_per_char;
+   }
+
+private:
+
+   static const std::size_t words_per_block = 8;
+
+   struct block_type
+   {
+      uint32_t word[words_per_block];
+   };
+
+   blocked_bloom_filter(const blocked_bloom_filter&);
+   blocked_bloom_filter& operator = (const blocked_bloom_filter&);
+
+   inline void compute_mask(const int64_t key, uint32_t*& block, uint32_t* mask) const
+   {
+      static const uint32_t salt[words_per_block] =
+                              {
+                                0x47B6137BU, 0x44974D91U, 0x8824AD5BU, 0xA2B7289DU,
+                                0x705495C7U, 0x2DF1424BU, 0x9EFC4947U, 0x5C6BFB31U
+                              };
+
+      // murmur3 finalizer
+      uint64_t hash = static_cast<uint64_t>(key);
+      hash ^= hash >> 33;
+      hash *= 0xFF51AFD7ED558CCDULL;
+      hash ^= hash >> 33;
+      hash *= 0xC4CEB9FE1A85EC53ULL;
+      hash ^= hash >> 33;
+
+      block = table_[(hash >> 32) & (block_count_ - 1)].word;
+
+      const uint32_t lo = static_cast<uint32_t>(hash);
+
+      for (std::size_t i = 0; i < words_per_block; ++i)
+      {
+         mask[i] = 1U << ((lo * salt[i]) >> 27);
+      }
+   }
+
+   block_type* table_;
+   std::size_t block_count_;
+};
+
 #endif
 
 
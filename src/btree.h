@@ -25,8 +25,20 @@
 #include <time.h>
 #include <unistd.h>
 #include <algorithm>
+#include <deque>
+#include <functional>
+#include <queue>
+#include <thread>
+#include <tuple>
 #include <vector>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include "hash.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "bloom_filter.hpp"
+#include "sortnet.h"
 
 #define PAGESIZE 512
 
@@ -38,6 +50,71 @@
 #define IS_FORWARD(c) (c % 2 == 0)
 int n_threads, eval_threads;
 
+// entry_count bit set once a future_Node is closed to further appends
+#define FUT_SEALED (1 << 30)
+
+// Buffered operations. INSERT and UPSERT are applied alike, as a write of
+// the key; they differ only in where the value comes from. A DELETE after
+// either cancels both when the tree does not hold the key, see
+// future_collapse.
+enum { FUT_INSERT, FUT_UPSERT, FUT_DELETE, FUT_DEAD };
+
+// What a producer does when its buffer is over the caps below
+enum { FUT_BLOCK, FUT_HELP, FUT_DIRECT };
+
+int fut_thread_cap = 0; // sealed blocks per producer, 0 = unbounded
+int fut_global_cap = 0; // sealed blocks over all producers, 0 = unbounded
+int fut_overflow = FUT_BLOCK;
+
+// Sealed blocks of its own above which a producer stops to apply its oldest
+// ones itself, through the same merged batch path as the evaluators, before
+// opening another block. Bounds the buffer of a producer that outpaces its
+// evaluator without waiting for a cap. 0 = never; ignored in partitioned
+// mode, where only the owner of a range may write it.
+int fut_help_depth = 0;
+
+// Give each evaluator a disjoint key range of the tree instead of a shared
+// pool. Must be set before the evaluators start.
+bool fut_partitioned = false;
+#define FUT_REBALANCE 4096 // blocks routed between range recomputations
+
+// Sealed blocks an evaluator merges into one sorted run before applying it
+int fut_merge_way = 8;
+
+// An evaluator with nothing to do spins this many times, then parks until a
+// block is sealed. While a home producer has a partially filled head it
+// wakes up after fut_idle_ns anyway, to seal the head once it goes idle.
+int fut_spin = 1024;
+long fut_idle_ns = 1000000;
+
+// Bound on how long an operation may wait in a partially filled head. A
+// head older than this is sealed even while its producer keeps appending.
+// Together with evaluators always taking the oldest sealed block, this
+// bounds how long a write stays invisible to readers that do not consult
+// the buffers. 0 = heads are only sealed when full or idle.
+long fut_max_stale_ns = 0;
+
+// Adaptive evaluator count. eval_threads evaluators are started but only the
+// first fut_active of them take new blocks. Evaluator 0 samples the buffers
+// every fut_control_ns and grows the set by one when there are more than
+// fut_grow_depth sealed blocks per active evaluator or the oldest has waited
+// fut_grow_age_ns, and shrinks it by one after FUT_SHRINK_SAMPLES quiet
+// samples, never below eval_threads_min. 0 keeps all eval_threads active;
+// partitioned mode always does, as its ranges are cut for eval_threads.
+int eval_threads_min = 0;
+int fut_grow_depth = 4;
+long fut_grow_age_ns = 2000000;
+long fut_control_ns = 1000000;
+#define FUT_SHRINK_SAMPLES 16
+
+// Adaptive bypass. While the leaf locks are quiet, fewer than
+// fut_bypass_waits contended acquisitions per fut_control_ns, a producer
+// whose buffer is empty sends its operations straight to the tree instead
+// of waiting for an evaluator. A busier window switches everyone back to
+// buffering until a window stays under the threshold again.
+bool fut_bypass = false;
+int fut_bypass_waits = 64;
+
 using entry_key_t = int64_t;
 
 pthread_mutex_t print_mtx;
@@ -79,6 +156,21 @@ inline void clflush(char *data, int len) {
   mfence();
 }
 
+static inline void futex_wait(int *addr, int val,
+                              const struct timespec *timeout = NULL) {
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static inline void futex_wake(int *addr, int n) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+static inline long monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
 class page;
 
 class header {
@@ -93,6 +185,8 @@ private:
 
   friend class page;
   friend class btree;
+  friend class btree_Cursor;
+  friend class btree_ReverseCursor;
 
 public:
   header() {
@@ -129,21 +223,184 @@ const int count_in_line = CACHE_LINE_SIZE / sizeof(entry);
 class future_Node{
     public:
         int64_t keys[cardinality];
+        char *ptrs[cardinality];
+        uint8_t ops[cardinality];
         int entry_count;
         bool is_done;
+        bool is_claimed;
         future_Node *next;
         future_Node *prev;
+        future_Node *parent; // block a routed piece was split from
+        int pending;         // routed pieces of this block not yet applied
+        int epoch;           // partition epoch a piece was routed under
+        uint64_t first_seq;  // sequence number of the first op appended
+        long opened_ns;      // monotonic time the block was linked
+        long sealed_ns;      // monotonic time the block was sealed
 
         future_Node(){
-            keys[0] = NULL;
+            keys[0] = 0;
             entry_count = 0;
             is_done = false;
+            is_claimed = false;
             next = NULL;
             prev = NULL;
+            parent = NULL;
+            pending = 0;
+            epoch = 0;
+            first_seq = 0;
+            opened_ns = 0;
+            sealed_ns = 0;
         }
         friend class btree;
 };
 
+// Without a node, a task applies producer tid's oldest unclaimed sealed
+// block, so a stale task is harmless. With one, it applies a routed piece
+// of that producer's block.
+class future_Task{
+    public:
+        int tid;
+        future_Node *node;
+        long sealed_ns; // when the block behind the task was sealed
+
+        future_Task(int tid = -1, future_Node *node = NULL, long sealed_ns = 0){
+            this->tid = tid;
+            this->node = node;
+            this->sealed_ns = sealed_ns;
+        }
+};
+
+// Per-evaluator task deque. Each sealed block enqueues a task on the deque
+// of the producer's home evaluator, or of the evaluator owning its range.
+// Tasks are queued in seal order, so the front is the oldest.
+class future_Deque{
+    public:
+        std::mutex mtx;
+        std::deque<future_Task> tasks;
+        int size;
+        long oldest; // sealed_ns of the front task, LONG_MAX when empty
+
+        future_Deque(){
+            size = 0;
+            oldest = LONG_MAX;
+        }
+};
+
+
+// A producer's two key filters, in front of its buffer index. Keys go into
+// the current one; the other holds the generation before. Once every
+// operation of that older generation is applied, future_push clears it and
+// makes it current, so neither fills up under steady ingest. Readers probe
+// both, without knowing which is current.
+class future_Bloom{
+    public:
+        blocked_bloom_filter *filter[2];
+        int cur;
+        uint64_t start; // first sequence number of the current generation
+        int blocks;     // blocks opened in the current generation
+        int gen_blocks; // blocks per generation, half a filter's capacity
+
+        future_Bloom(){
+            filter[0] = filter[1] = NULL;
+            cur = 0;
+            start = 1;
+            blocks = 0;
+            gen_blocks = 1;
+        }
+
+        void insert(int64_t key){
+            filter[cur]->insert(key);
+        }
+
+        bool contains(int64_t key){
+            return filter[0]->contains(key) || filter[1]->contains(key);
+        }
+};
+
+// Callbacks waiting for a producer's operations to reach the tree, in
+// sequence order.
+class future_Callbacks{
+    public:
+        std::mutex mtx;
+        std::deque<std::pair<uint64_t, std::function<void()> > > pending;
+        int size;
+
+        future_Callbacks(){
+            size = 0;
+        }
+};
+
+class btree;
+
+// Completion handle of a buffered operation: producer and sequence number.
+class future_Token{
+    public:
+        btree *bt;
+        int tid;
+        uint64_t seq;
+
+        future_Token(btree *bt = NULL, int tid = 0, uint64_t seq = 0){
+            this->bt = bt;
+            this->tid = tid;
+            this->seq = seq;
+        }
+        bool ready();
+        void wait();
+};
+
+// Forward cursor over the leaves. seek() positions it at the first key >= a
+// given key, and next() and next_batch() then return pairs in increasing
+// key order, stopping before end. Each leaf is copied out once, validated
+// against its switch_counter like linear_search, so what is handed out does
+// not change underneath the caller when writers shift the page. Keys come
+// out strictly increasing: keys a split moved into the next leaf after they
+// were returned are skipped, and a leaf merged away is re-entered from the
+// root.
+class btree_Cursor{
+    public:
+        btree_Cursor(btree *bt, entry_key_t end = LONG_MAX);
+        void seek(entry_key_t);
+        bool next(entry_key_t *, char **);
+        int next_batch(entry_key_t *, char **, int);
+        long leaves() const { return copied; }
+
+    private:
+        bool fill();
+
+        btree *bt;
+        page *leaf;             // next leaf to copy, NULL past the last
+        long copied;            // leaves copied since construction
+        entry_key_t end;
+        entry_key_t from;       // smallest key not returned yet
+        entry_key_t keys[cardinality];
+        char *ptrs[cardinality];
+        int n, pos;             // copied pairs, and the next one to return
+};
+
+// Backward counterpart of btree_Cursor. seek() positions it at the last key
+// <= a given key, and pairs come out in decreasing key order, down to
+// begin. Leaves have no back links, so the next leaf down is found from the
+// root: the separators on the way down give the lowest key the current
+// leaf can hold, and the descent for the key just below it leads to the
+// leaf before. That is one descent per leaf, on top of one page copy.
+class btree_ReverseCursor{
+    public:
+        btree_ReverseCursor(btree *bt, entry_key_t begin = LONG_MIN);
+        void seek(entry_key_t);
+        bool next(entry_key_t *, char **);
+        int next_batch(entry_key_t *, char **, int);
+
+    private:
+        bool fill();
+
+        btree *bt;
+        entry_key_t begin;
+        entry_key_t from;       // largest key not returned yet
+        bool done;              // the leftmost leaf has been copied
+        entry_key_t keys[cardinality];
+        char *ptrs[cardinality];
+        int n, pos;
+};
 
 class btree {
 private:
@@ -152,23 +409,96 @@ private:
   future_Node *local_fut;
   future_Node *local_fut_tail;
   HashMapTable *hash;
+  future_Bloom *fut_bloom; // per-producer, in front of hash[]
+  std::mutex *fut_mtx; // per-producer, guards the block list links
+  int fut_blocks;      // sealed, unapplied blocks over all producers
+  int fut_waiters;     // producers parked on a buffer cap
+  int fut_applied;     // bumped on every release, for future_sync
+  uint64_t *fut_seq;   // per-producer, last operation issued
+  int fut_signal;      // bumped whenever evaluators have new work
+  int fut_parked;      // evaluators asleep on fut_signal
+  int fut_shutdown;    // set once no more operations will be buffered
+  int fut_active;      // evaluators taking new blocks
+  int fut_resized;     // bumped on every resize and on shutdown
+  int fut_calm;        // quiet samples in a row, evaluator 0 only
+  int fut_waits;       // contended leaf locks in this bypass window
+  int fut_direct;      // operations bypass the buffers, see fut_bypass
+  long fut_window;     // start of the current bypass window
+  future_Callbacks *fut_callbacks; // per-producer
+  future_Deque *fut_tasks;
+  entry_key_t *fut_bounds;     // evaluator e owns [fut_bounds[e-1], fut_bounds[e])
+  int fut_nbounds;
+  int fut_epoch;
+  int fut_routed;
+  pthread_rwlock_t fut_part_lock;
 
 public:
   bool is_Done = false;
   btree();
   void setNewRoot(char *);
   void getNumberOfNodes();
-  void btree_insert(entry_key_t, char *);
+  void btree_insert(entry_key_t, char *, bool with_lock = true);
+  void btree_insert_batch(entry_key_t *, char **, int, bool with_lock = true);
   void btree_insert_internal(char *, entry_key_t, char *, uint32_t);
   void btree_delete(entry_key_t);
   void btree_delete_internal(entry_key_t, char *, uint32_t, entry_key_t *,
                              bool *, page **);
   char *btree_search(entry_key_t);
+  bool btree_holds(entry_key_t);
+  page *btree_lock_leaf(entry_key_t);
+  page *btree_search_leaf(entry_key_t);
+  page *btree_search_leaf(entry_key_t, entry_key_t *);
   void btree_search_range(entry_key_t, entry_key_t, unsigned long *);
+  int btree_search_range(entry_key_t, entry_key_t, unsigned long *, int);
+  void btree_split_range(entry_key_t, entry_key_t, int, vector<entry_key_t> *);
+  long btree_search_range_parallel(entry_key_t, entry_key_t, int,
+                                   vector<entry_key_t> *, vector<char *> *);
+  long btree_search_range_merged(entry_key_t, entry_key_t,
+                                 vector<entry_key_t> *, vector<char *> *,
+                                 bool drain = false);
   void printAll();
-  void future_insert(entry_key_t, int, bool);
+  uint64_t future_insert(entry_key_t, int, bool);
+  uint64_t future_upsert(entry_key_t, char *, int);
+  uint64_t future_delete(entry_key_t, int);
+  uint64_t future_append(entry_key_t, char *, int, int);
+  uint64_t future_applied_seq(int);
+  uint64_t future_sync(int, uint64_t seq = UINT64_MAX);
+  void future_sync_all();
+  future_Token future_insert_async(entry_key_t, int);
+  void future_insert_async(entry_key_t, int, std::function<void()>);
+  void future_on_applied(int, uint64_t, std::function<void()>);
+  void future_run_callbacks(int);
+  void future_shutdown();
+  void future_wake();
+  int future_home(int);
+  bool future_adaptive();
+  void future_control();
+  void future_resize(int);
+  long future_oldest_age(long);
+  int future_collapse(entry_key_t, int, int);
+  void future_sort(future_Node *);
   void future_evaluate(btree *, int);
   void future_evaluate_execute(btree *, int, int);
+  void future_enqueue(int, future_Task);
+  bool future_next_task(int, future_Task *);
+  bool future_seal_idle(int, int *, bool *);
+  bool future_seal(int, future_Node *);
+  void future_publish(int, future_Node *);
+  void future_route(int, future_Node *, future_Node *);
+  void future_evaluate_piece(future_Task);
+  void future_partition();
+  void future_link(int, future_Node *);
+  void future_unlink(int, future_Node *);
+  future_Node *future_push(int);
+  future_Node *future_claim(int);
+  void future_apply(future_Node *, bool with_lock = true);
+  void future_apply_merged(vector<future_Node *> &);
+  void future_release(int, future_Node *);
+  bool future_reserve(int);
+  int future_help(int);
+  bool future_drained(int);
+  bool future_bypass(int);
+  void future_direct(entry_key_t, char *, int, int);
 
   friend class page;
   friend class HashMapTable;
@@ -181,6 +511,8 @@ private:
 
 public:
   friend class btree;
+  friend class btree_Cursor;
+  friend class btree_ReverseCursor;
 
   page(uint32_t level = 0) {
     hdr.level = level;
@@ -206,6 +538,13 @@ public:
     return ret;
   }
 
+  // Leaf keys from the fence up belong to the right sibling. It is the key
+  // the leaf was last split at, LONG_MAX before any split, and unlike the
+  // sibling's first key it stays put when that key is deleted, so a key
+  // never lands left of where the parent's separator sends it. Kept in the
+  // key of the last slot, which only ever serves as the NULL terminator.
+  entry_key_t fence() { return records[cardinality - 1].key; }
+
   inline int count() {
     uint8_t previous_switch_counter;
     int count = 0;
@@ -592,12 +931,21 @@ public:
     ++(*num_entries);
   }
 
+  // Take the write lock, counting it in bt->fut_waits when another writer
+  // holds it, which is what fut_bypass measures contention by.
+  inline void lock(btree *bt) {
+    if (!hdr.mtx->try_lock()) {
+      __atomic_add_fetch(&bt->fut_waits, 1, __ATOMIC_RELAXED);
+      hdr.mtx->lock();
+    }
+  }
+
   // Insert a new key - FAST and FAIR
   page *store(btree *bt, char *left, entry_key_t key, char *right, bool flush,
               bool with_lock, page *invalid_sibling = NULL) {
     
     if (with_lock) {
-      hdr.mtx->lock(); // Lock the write lock
+      lock(bt); // Lock the write lock
     }
     if (hdr.is_deleted) {
       if (with_lock) {
@@ -609,8 +957,10 @@ public:
 
     // If this node has a sibling node,
     if (hdr.sibling_ptr && (hdr.sibling_ptr != invalid_sibling)) {
-      // Compare this key with the first key of the sibling
-      if (key > hdr.sibling_ptr->records[0].key) {
+      // Compare this key with the first key of the sibling, or for a leaf
+      // with the fence
+      if (hdr.leftmost_ptr == NULL ? key >= fence()
+                                   : key > hdr.sibling_ptr->records[0].key) {
         if (with_lock) {
           hdr.mtx->unlock(); // Unlock the write lock
         }
@@ -653,11 +1003,19 @@ public:
       }
 
       sibling->hdr.sibling_ptr = hdr.sibling_ptr;
+      if (hdr.leftmost_ptr == NULL)
+        sibling->records[cardinality - 1].key = fence();
       clflush((char *)sibling, sizeof(page));
 
       hdr.sibling_ptr = sibling;
       clflush((char *)&hdr, sizeof(hdr));
 
+      // Before the cut below, so readers that miss a moved key go right
+      if (hdr.leftmost_ptr == NULL) {
+        records[cardinality - 1].key = split_key;
+        clflush((char *)&records[cardinality - 1], sizeof(entry));
+      }
+
       // set to NULL
       if (IS_FORWARD(hdr.switch_counter))
         hdr.switch_counter += 2;
@@ -703,6 +1061,148 @@ public:
     }
   }
 
+  // Write a whole slot with one 16-byte store, so a reader never pairs a
+  // key with another slot's pointer while slots move more than one step.
+  static inline void store_entry(entry *e, entry_key_t key, char *ptr) {
+#ifdef __SSE2__
+    _mm_store_si128((__m128i *)e, _mm_set_epi64x((long long)ptr, key));
+#else
+    e->ptr = ptr;
+    e->key = key;
+#endif
+  }
+
+  // Merge t sorted keys, all absent from this node, in one right-to-left
+  // pass. Every slot moves straight to its final position, and the range
+  // is flushed once at the end. Caller holds the lock and has checked that
+  // the keys fit.
+  inline void merge_keys(entry_key_t *keys, char **ptrs, int t,
+                         int *num_entries) {
+    if (!IS_FORWARD(hdr.switch_counter))
+      ++hdr.switch_counter;
+
+    int s = *num_entries - 1, d = *num_entries + t - 1, a = t - 1;
+    records[d + 1].ptr = NULL;
+    while (a >= 0) {
+      if (s >= 0 && records[s].key > keys[a]) {
+        store_entry(&records[d], records[s].key, records[s].ptr);
+        --s;
+      } else {
+        store_entry(&records[d], keys[a], ptrs[a]);
+        --a;
+      }
+      --d;
+    }
+    clflush((char *)&records[d + 1],
+            (*num_entries + t - d) * sizeof(entry));
+
+    *num_entries += t;
+    hdr.last_index = *num_entries - 1;
+    clflush((char *)&(hdr.last_index), sizeof(int16_t));
+  }
+
+  // Insert a sorted batch into this leaf. Takes the prefix of the batch
+  // that belongs here, below both the parent's separator (bound) and the
+  // sibling's first key, overwrites keys the leaf already holds, and merges
+  // as many new keys as fit. A full leaf is split by a regular store of the
+  // next key. Returns how many keys of the batch were consumed; 0 means the
+  // leaf was deleted and the caller has to descend again.
+  int store_batch(btree *bt, entry_key_t *keys, char **ptrs, int n,
+                  entry_key_t bound, bool with_lock) {
+    if (with_lock) {
+      lock(bt);
+    }
+    if (hdr.is_deleted) {
+      if (with_lock) {
+        hdr.mtx->unlock();
+      }
+      return 0;
+    }
+
+    if (hdr.sibling_ptr) {
+      if (keys[0] >= fence()) {
+        if (with_lock) {
+          hdr.mtx->unlock();
+        }
+        return hdr.sibling_ptr->store_batch(bt, keys, ptrs, n, bound,
+                                            with_lock);
+      }
+      // The separator of a split that has not reached the parent yet
+      if (fence() < bound)
+        bound = fence();
+    }
+    int m = lower_bound(keys, keys + n, bound) - keys;
+
+    int num_entries = count();
+    int room = cardinality - 1 - num_entries;
+    entry_key_t add_keys[cardinality];
+    char *add_ptrs[cardinality];
+    int t = 0, used = 0, r = 0;
+
+    while (used < m) {
+      // Equal keys in a batch are in write order, the last one wins.
+      int j = used;
+      while (j + 1 < m && keys[j + 1] == keys[j])
+        ++j;
+
+      while (r < num_entries && records[r].key < keys[j])
+        ++r;
+      if (r < num_entries && records[r].key == keys[j]) {
+        records[r].ptr = ptrs[j];
+        clflush((char *)&records[r].ptr, sizeof(char *));
+      } else {
+        if (t == room)
+          break;
+        add_keys[t] = keys[j];
+        add_ptrs[t] = ptrs[j];
+        ++t;
+      }
+      used = j + 1;
+    }
+
+    if (t > 0)
+      merge_keys(add_keys, add_ptrs, t, &num_entries);
+
+    if (with_lock) {
+      hdr.mtx->unlock();
+    }
+
+    if (used == 0) {
+      if (!store(bt, NULL, keys[0], ptrs[0], true, with_lock))
+        return 0;
+      used = 1;
+    }
+    return used;
+  }
+
+  // Smallest separator of this internal node above key, which bounds the
+  // child linear_search(key) descends into. Returns LONG_MAX for the last
+  // child, whose bound is the one of this node. Each key is read once: a
+  // writer shifting the node may change it between two reads, and a bound
+  // at or below key would keep the key out of its own leaf.
+  entry_key_t separator_after(entry_key_t key) {
+    entry_key_t k;
+    for (int i = 0; records[i].ptr != NULL; ++i) {
+      if (key < (k = records[i].key))
+        return k;
+    }
+    return LONG_MAX;
+  }
+
+  // Largest separator of this internal node at or below key, the lowest key
+  // of the child linear_search(key) descends into. Returns LONG_MIN for the
+  // leftmost child, whose lower bound is the one of this node. Each key is
+  // read once, see separator_after.
+  entry_key_t separator_before(entry_key_t key) {
+    entry_key_t sep = LONG_MIN, k;
+    for (int i = 0; records[i].ptr != NULL; ++i) {
+      if (key < (k = records[i].key))
+        break;
+      sep = k;
+    }
+    return sep;
+  }
+
   // Search keys with linear search
   void linear_search_range(entry_key_t min, entry_key_t max,
                            unsigned long *buf) {
@@ -782,6 +1282,57 @@ public:
     }
   }
 
+  // Whether key belongs to the right sibling, which only happens after a
+  // split this page's readers have not caught up with.
+  bool sibling_starts_by(entry_key_t key) {
+    return hdr.sibling_ptr != NULL && key >= fence();
+  }
+
+  // Copy the entries with a key >= min into keys and ptrs in increasing key
+  // order, and return how many there are. Validated against switch_counter
+  // like linear_search; a slot caught halfway through a shift, holding its
+  // neighbour's pointer or a key out of order, is left out.
+  int scan(entry_key_t min, entry_key_t *keys, char **ptrs) {
+    uint8_t previous_switch_counter;
+    int n;
+    entry_key_t k;
+    char *t;
+
+    do {
+      previous_switch_counter = hdr.switch_counter;
+      n = 0;
+
+      if (IS_FORWARD(previous_switch_counter)) {
+        for (int i = 0; (t = records[i].ptr) != NULL; ++i) {
+          k = records[i].key;
+          if (i > 0 && records[i - 1].ptr == t)
+            continue;
+          if (k >= min && (n == 0 || k > keys[n - 1]) && k == records[i].key) {
+            keys[n] = k;
+            ptrs[n++] = t;
+          }
+        }
+      } else {
+        // Right to left, then reversed.
+        for (int i = count() - 1; i >= 0; --i) {
+          if ((t = records[i].ptr) == NULL)
+            continue;
+          k = records[i].key;
+          if (i > 0 && records[i - 1].ptr == t)
+            continue;
+          if (k >= min && (n == 0 || k < keys[n - 1]) && k == records[i].key) {
+            keys[n] = k;
+            ptrs[n++] = t;
+          }
+        }
+        std::reverse(keys, keys + n);
+        std::reverse(ptrs, ptrs + n);
+      }
+    } while (previous_switch_counter != hdr.switch_counter);
+
+    return n;
+  }
+
   char *linear_search(entry_key_t key) {
     int i = 1;
     uint8_t previous_switch_counter;
@@ -844,7 +1395,7 @@ public:
         return ret;
       }
 
-      if ((t = (char *)hdr.sibling_ptr) && key >= ((page *)t)->records[0].key)
+      if ((t = (char *)hdr.sibling_ptr) && key >= fence())
         return t;
 
       return NULL;
@@ -956,6 +1507,42 @@ btree::btree() {
   local_fut = (future_Node *)new future_Node[n_threads];
   local_fut_tail = (future_Node *) new future_Node[n_threads];
   hash = (HashMapTable *) new HashMapTable[n_threads];
+  fut_mtx = new std::mutex[n_threads];
+  fut_bloom = new future_Bloom[n_threads];
+  for (int i = 0; i < n_threads; i++) {
+    size_t keys = fut_thread_cap > 0 ? (fut_thread_cap + 1) * cardinality : 8192;
+    fut_bloom[i].filter[0] = new blocked_bloom_filter(keys);
+    fut_bloom[i].filter[1] = new blocked_bloom_filter(keys);
+    fut_bloom[i].gen_blocks = std::max<size_t>(1, keys / (2 * cardinality));
+  }
+  fut_blocks = 0;
+  fut_waiters = 0;
+  fut_applied = 0;
+  fut_signal = 0;
+  fut_parked = 0;
+  fut_shutdown = 0;
+  fut_active = eval_threads;
+  if(future_adaptive())
+    fut_active = std::min(eval_threads_min, eval_threads);
+  fut_resized = 0;
+  fut_calm = 0;
+  fut_waits = 0;
+  fut_direct = 1;
+  fut_window = monotonic_ns();
+  fut_callbacks = new future_Callbacks[n_threads];
+  fut_seq = new uint64_t[n_threads]();
+  fut_tasks = new future_Deque[eval_threads];
+  fut_bounds = NULL;
+  fut_nbounds = 0;
+  fut_epoch = 0;
+  fut_routed = 0;
+
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&fut_part_lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
 }
 
 void btree::setNewRoot(char *new_root) {
@@ -965,13 +1552,16 @@ void btree::setNewRoot(char *new_root) {
 }
 
 char *btree::btree_search(entry_key_t key) {
-  int index;
+  // A key still waiting in a producer's buffer is newer than the tree.
+  // The filters let us skip the indexes of producers that never saw it.
+  // A buffered delete is indexed with a NULL value.
+  // Any value can be buffered, -1 included, so go by Lookup's flag.
+  int64_t buffered, tag;
   for(int i = 0; i < n_threads; i++){
-    if((index = hash->SearchKey(key))!= NULL)
-      //printf("Key Found\n");
-      break;
-    
+    if(fut_bloom[i].contains(key) && hash[i].Lookup(key, &buffered, &tag))
+      return (char *)buffered;
   }
+
   page *p = (page *)root;
 
   while (p->hdr.leftmost_ptr != NULL) {
@@ -995,15 +1585,50 @@ char *btree::btree_search(entry_key_t key) {
 }
 
 // insert the key in the leaf node
-void btree::btree_insert(entry_key_t key, char *right) { // need to be string
+// with_lock = false skips the leaf lock; only valid when no other thread
+// can write the same leaf (see fut_partitioned)
+void btree::btree_insert(entry_key_t key, char *right,
+                         bool with_lock) { // need to be string
   page *p = (page *)root;
 
   while (p->hdr.leftmost_ptr != NULL) {
     p = (page *)p->linear_search(key);
   }
 
-  if (!p->store(this, NULL, key, right, true, true)) { // store
-    btree_insert(key, right);
+  if (!p->store(this, NULL, key, right, true, with_lock)) { // store
+    btree_insert(key, right, with_lock);
+  }
+}
+
+// insert a batch of keys sorted in ascending order, descending once per
+// target leaf instead of once per key
+void btree::btree_insert_batch(entry_key_t *keys, char **ptrs, int n,
+                               bool with_lock) {
+  int i = 0;
+
+  // Neighbouring keys with one value look like a shift in progress to the
+  // lock-free readers, which then skip one of them; see future_upsert.
+  for (int j = 1; j < n; ++j)
+    assert(keys[j] == keys[j - 1] || ptrs[j] != ptrs[j - 1]);
+
+  while (i < n) {
+    page *p = (page *)root;
+    // The separators on the way down bound the leaf's key range. The
+    // sibling's first key alone is not enough: deleting it leaves the
+    // separator where it was.
+    entry_key_t bound = LONG_MAX;
+
+    while (p->hdr.leftmost_ptr != NULL) {
+      page *next = (page *)p->linear_search(keys[i]);
+      if (next != p->hdr.sibling_ptr) {
+        entry_key_t sep = p->separator_after(keys[i]);
+        if (sep < bound)
+          bound = sep;
+      }
+      p = next;
+    }
+
+    i += p->store_batch(this, keys + i, ptrs + i, n - i, bound, with_lock);
   }
 }
 
@@ -1024,26 +1649,13 @@ void btree::btree_insert_internal(char *left, entry_key_t key, char *right,
 }
 
 void btree::btree_delete(entry_key_t key) {
-  page *p = (page *)root;
-
-  while (p->hdr.leftmost_ptr != NULL) {
-    p = (page *)p->linear_search(key);
-  }
-
-  page *t;
-  while ((t = (page *)p->linear_search(key)) == p->hdr.sibling_ptr) {
-    p = t;
-    if (!p)
-      break;
-  }
-
-  if (p) {
-    if (!p->remove(this, key)) {
-      btree_delete(key);
-    }
-  } else {
-    printf("not found the key to delete %lu\n", key);
-  }
+  // Looked for under the leaf lock: the lock-free search can miss a key
+  // while another writer shifts the leaf. A missing key is routine once
+  // deletes are buffered: the key may have been deleted already, or never
+  // reached the tree.
+  page *p = btree_lock_leaf(key);
+  p->remove_key(key);
+  p->hdr.mtx->unlock();
 }
 
 void btree::btree_delete_internal(entry_key_t key, char *ptr, uint32_t level,
@@ -1109,6 +1721,419 @@ void btree::btree_search_range(entry_key_t min, entry_key_t max,
   }
 }
 
+// Same as above, but writes at most limit values and returns how many it
+// wrote, so buf only needs room for limit. Both bounds are exclusive, as in
+// the baseline scan; btree_search_range_parallel and
+// btree_search_range_merged take [min, max) instead, like btree_Cursor.
+int btree::btree_search_range(entry_key_t min, entry_key_t max,
+                              unsigned long *buf, int limit) {
+  btree_Cursor cursor(this, max);
+  entry_key_t key;
+  char *ptr;
+  int off = 0;
+
+  if (min == LONG_MAX)
+    return 0;
+  cursor.seek(min + 1);
+  while (off < limit && cursor.next(&key, &ptr))
+    buf[off++] = (unsigned long)ptr;
+
+  return off;
+}
+
+// Cut [min, max) into at most parts sub-ranges at inner-node separators, so
+// each covers about as many leaves. Levels are read from the root down, each
+// node copied with page::scan, and only as deep as it takes to find a few
+// separators per part. cuts gets the bounds, min first and max last;
+// sub-range i is [cuts[i], cuts[i + 1]).
+void btree::btree_split_range(entry_key_t min, entry_key_t max, int parts,
+                              vector<entry_key_t> *cuts) {
+  vector<entry_key_t> seps;
+  entry_key_t keys[cardinality];
+  char *ptrs[cardinality];
+
+  for (int level = ((page *)root)->hdr.level; level > 0; --level) {
+    page *p = (page *)root;
+    while ((int)p->hdr.level > level)
+      p = (page *)p->linear_search(min);
+
+    for (; p != NULL; p = p->hdr.sibling_ptr) {
+      int n = p->scan(min, keys, ptrs);
+      bool past = false;
+      for (int i = 0; i < n; ++i) {
+        if (keys[i] >= max) {
+          past = true;
+          break;
+        }
+        if (keys[i] > min)
+          seps.push_back(keys[i]);
+      }
+      if (past)
+        break;
+    }
+    if ((int)seps.size() >= 4 * parts)
+      break;
+  }
+  sort(seps.begin(), seps.end());
+  seps.erase(unique(seps.begin(), seps.end()), seps.end());
+
+  cuts->clear();
+  cuts->push_back(min);
+  for (int i = 1; i < parts && !seps.empty(); ++i) {
+    entry_key_t c = seps[(size_t)i * seps.size() / parts];
+    if (c > cuts->back())
+      cuts->push_back(c);
+  }
+  if (max > cuts->back())
+    cuts->push_back(max);
+}
+
+// Scan [min, max) with one btree_Cursor per sub-range of btree_split_range,
+// and append the pairs to keys and ptrs in key order. Unlike the bounded
+// btree_search_range, min is included. The calling thread scans the first
+// sub-range and parts - 1 threads are started for the others, so a range
+// that fits one part, or parts = 1, starts none. Callers that can consume
+// the sub-ranges as separate streams can run the cursors themselves.
+// Returns how many pairs were found.
+long btree::btree_search_range_parallel(entry_key_t min, entry_key_t max,
+                                        int parts, vector<entry_key_t> *keys,
+                                        vector<char *> *ptrs) {
+  vector<entry_key_t> cuts;
+  btree_split_range(min, max, parts, &cuts);
+
+  int n = (int)cuts.size() - 1;
+  if (n <= 0)
+    return 0;
+  vector<vector<entry_key_t> > part_keys(n);
+  vector<vector<char *> > part_ptrs(n);
+  vector<std::thread> threads;
+  auto scan = [&](int i) {
+    btree_Cursor cursor(this, cuts[i + 1]);
+    entry_key_t k[cardinality];
+    char *v[cardinality];
+    int got;
+
+    cursor.seek(cuts[i]);
+    while ((got = cursor.next_batch(k, v, cardinality)) > 0) {
+      part_keys[i].insert(part_keys[i].end(), k, k + got);
+      part_ptrs[i].insert(part_ptrs[i].end(), v, v + got);
+    }
+  };
+
+  for (int i = 1; i < n; ++i)
+    threads.push_back(std::thread(scan, i));
+  scan(0);
+  for (size_t i = 0; i < threads.size(); ++i)
+    threads[i].join();
+
+  long total = 0;
+  for (int i = 0; i < n; ++i) {
+    keys->insert(keys->end(), part_keys[i].begin(), part_keys[i].end());
+    ptrs->insert(ptrs->end(), part_ptrs[i].begin(), part_ptrs[i].end());
+    total += part_keys[i].size();
+  }
+  return total;
+}
+
+// Scan [min, max), min included as in btree_search_range_parallel, the way
+// btree_search sees it: an operation still waiting in a producer's buffer
+// overrides the tree, and a buffered delete hides the key.
+// The buffers are read before the tree, and an evaluator takes a key out of
+// a buffer only after applying it, so every key comes out at least as new
+// as it was on entry. Each producer's index is scanned whole, which costs
+// its capacity. With drain, the producers holding keys in the range first
+// get what they had issued applied, see future_sync, and the overlay only
+// has to cover what arrives during the scan. Appends the pairs to keys and
+// ptrs in key order and returns how many there were.
+long btree::btree_search_range_merged(entry_key_t min, entry_key_t max,
+                                      vector<entry_key_t> *keys,
+                                      vector<char *> *ptrs, bool drain) {
+  vector<int64_t> k, v;
+
+  if(drain){
+    vector<uint64_t> issued(n_threads);
+    for(int i = 0; i < n_threads; i++)
+      issued[i] = __atomic_load_n(&fut_seq[i], __ATOMIC_ACQUIRE);
+    for(int i = 0; i < n_threads; i++){
+      k.clear();
+      v.clear();
+      hash[i].Scan(min, max, &k, &v);
+      if(!k.empty())
+        future_sync(i, issued[i]);
+    }
+  }
+
+  // Sorted by key, then producer, so the first of a key is the one
+  // btree_search would return.
+  vector<std::tuple<entry_key_t, int, char *> > buffered;
+  for(int i = 0; i < n_threads; i++){
+    k.clear();
+    v.clear();
+    hash[i].Scan(min, max, &k, &v);
+    for(size_t j = 0; j < k.size(); j++)
+      buffered.push_back(std::make_tuple(k[j], i, (char *)v[j]));
+  }
+  sort(buffered.begin(), buffered.end());
+
+  btree_Cursor cursor(this, max);
+  entry_key_t tk[cardinality];
+  char *tp[cardinality];
+  int got = 0, pos = 0;
+  size_t b = 0;
+  long total = 0;
+
+  cursor.seek(min);
+  while(true){
+    if(pos == got){
+      got = cursor.next_batch(tk, tp, cardinality);
+      pos = 0;
+    }
+    bool tree = pos < got;
+    if(!tree && b == buffered.size())
+      break;
+
+    entry_key_t key;
+    char *ptr;
+    if(b < buffered.size() &&
+       (!tree || std::get<0>(buffered[b]) <= tk[pos])){
+      key = std::get<0>(buffered[b]);
+      ptr = std::get<2>(buffered[b]);
+      while(b < buffered.size() && std::get<0>(buffered[b]) == key)
+        ++b;
+      if(tree && tk[pos] == key)
+        ++pos;
+      if(ptr == NULL)
+        continue;
+    } else {
+      key = tk[pos];
+      ptr = tp[pos++];
+    }
+    keys->push_back(key);
+    ptrs->push_back(ptr);
+    ++total;
+  }
+  return total;
+}
+
+// Whether the tree itself, leaving the buffers aside, holds key. The leaf
+// is read under its lock, so a writer shifting it cannot hide the key as
+// it can from lock-free readers. Only exact while leaf writers take the
+// lock, which partitioned evaluators do not.
+bool btree::btree_holds(entry_key_t key) {
+  page *p = btree_lock_leaf(key);
+  bool found = false;
+
+  for (int i = 0; p->records[i].ptr != NULL; ++i) {
+    if (p->records[i].key == key) {
+      found = true;
+      break;
+    }
+  }
+  p->hdr.mtx->unlock();
+  return found;
+}
+
+// The leaf that holds key if the tree does, returned locked.
+page *btree::btree_lock_leaf(entry_key_t key) {
+  page *p = btree_search_leaf(key);
+
+  while (true) {
+    p->hdr.mtx->lock();
+    if (!p->hdr.is_deleted && !p->sibling_starts_by(key))
+      return p;
+
+    page *next = p->hdr.is_deleted ? btree_search_leaf(key)
+                                   : p->hdr.sibling_ptr;
+    p->hdr.mtx->unlock();
+    p = next;
+  }
+}
+
+// The leaf linear_search leads to from the root for key.
+page *btree::btree_search_leaf(entry_key_t key) {
+  page *p = (page *)root;
+
+  while (p->hdr.leftmost_ptr != NULL)
+    p = (page *)p->linear_search(key);
+  return p;
+}
+
+// Same, and sets *low to the lowest key the leaf can hold as far as the
+// separators on the way down and the leaf siblings tell.
+page *btree::btree_search_leaf(entry_key_t key, entry_key_t *low) {
+  page *p = (page *)root;
+  entry_key_t lo = LONG_MIN;
+
+  while (p->hdr.leftmost_ptr != NULL) {
+    page *next = (page *)p->linear_search(key);
+    if (next != p->hdr.sibling_ptr) {
+      entry_key_t sep = p->separator_before(key);
+      if (sep > lo)
+        lo = sep;
+    }
+    p = next;
+  }
+
+  // A split that has not reached the parent yet
+  while (p->sibling_starts_by(key)) {
+    lo = p->fence();
+    p = p->hdr.sibling_ptr;
+  }
+
+  *low = lo;
+  return p;
+}
+
+btree_Cursor::btree_Cursor(btree *bt, entry_key_t end) {
+  this->bt = bt;
+  this->end = end;
+  leaf = NULL;
+  from = end;
+  n = pos = 0;
+  copied = 0;
+}
+
+void btree_Cursor::seek(entry_key_t key) {
+  leaf = bt->btree_search_leaf(key);
+  from = key;
+  n = pos = 0;
+}
+
+// Copy the next leaf with anything in [from, end). The sibling pointer is
+// read after the copy, so a split that happens in between is followed into
+// the new leaf rather than skipped.
+bool btree_Cursor::fill() {
+  n = pos = 0;
+
+  while (leaf != NULL && from < end) {
+    if (leaf->hdr.is_deleted) {
+      leaf = bt->btree_search_leaf(from);
+      continue;
+    }
+
+    n = leaf->scan(from, keys, ptrs);
+    ++copied;
+    leaf = leaf->hdr.sibling_ptr;
+    // A key at or past end here means no later leaf is in range.
+    if (n > 0 && keys[n - 1] >= end) {
+      leaf = NULL;
+      while (n > 0 && keys[n - 1] >= end)
+        --n;
+    }
+    if (n > 0) {
+      if (keys[n - 1] == LONG_MAX)
+        leaf = NULL;
+      else
+        from = keys[n - 1] + 1;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool btree_Cursor::next(entry_key_t *key, char **ptr) {
+  if (pos == n && !fill())
+    return false;
+
+  *key = keys[pos];
+  *ptr = ptrs[pos];
+  ++pos;
+  return true;
+}
+
+// Return up to max pairs, fewer only at the end of the range.
+int btree_Cursor::next_batch(entry_key_t *keys, char **ptrs, int max) {
+  int got = 0;
+
+  while (got < max) {
+    if (pos == n && !fill())
+      break;
+    int take = std::min(n - pos, max - got);
+    memcpy(keys + got, this->keys + pos, take * sizeof(entry_key_t));
+    memcpy(ptrs + got, this->ptrs + pos, take * sizeof(char *));
+    pos += take;
+    got += take;
+  }
+
+  return got;
+}
+
+btree_ReverseCursor::btree_ReverseCursor(btree *bt, entry_key_t begin) {
+  this->bt = bt;
+  this->begin = begin;
+  from = begin;
+  done = true;
+  n = pos = 0;
+}
+
+void btree_ReverseCursor::seek(entry_key_t key) {
+  from = key;
+  done = false;
+  n = pos = 0;
+}
+
+// Copy the next leaf down with anything in [begin, from], largest first.
+bool btree_ReverseCursor::fill() {
+  n = pos = 0;
+
+  while (!done && from >= begin) {
+    entry_key_t low;
+    page *leaf = bt->btree_search_leaf(from, &low);
+    if (leaf->hdr.is_deleted)
+      continue;
+
+    n = leaf->scan(std::max(low, begin), keys, ptrs);
+    // A split since the descent has moved the top of the leaf, possibly
+    // keys up to from, into a new sibling the copy did not see. The split
+    // links the sibling before it cuts the leaf, so it shows here; go down
+    // again rather than step past those keys.
+    if (leaf->sibling_starts_by(from))
+      continue;
+    while (n > 0 && keys[n - 1] > from)
+      --n;
+    if (low <= begin)
+      done = true;
+    else
+      from = low - 1;
+
+    if (n > 0) {
+      std::reverse(keys, keys + n);
+      std::reverse(ptrs, ptrs + n);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool btree_ReverseCursor::next(entry_key_t *key, char **ptr) {
+  if (pos == n && !fill())
+    return false;
+
+  *key = keys[pos];
+  *ptr = ptrs[pos];
+  ++pos;
+  return true;
+}
+
+// Return up to max pairs, fewer only at the start of the range.
+int btree_ReverseCursor::next_batch(entry_key_t *keys, char **ptrs, int max) {
+  int got = 0;
+
+  while (got < max) {
+    if (pos == n && !fill())
+      break;
+    int take = std::min(n - pos, max - got);
+    memcpy(keys + got, this->keys + pos, take * sizeof(entry_key_t));
+    memcpy(ptrs + got, this->ptrs + pos, take * sizeof(char *));
+    pos += take;
+    got += take;
+  }
+
+  return got;
+}
+
 void btree::printAll() {
   pthread_mutex_lock(&print_mtx);
   int total_keys = 0;
@@ -1131,84 +2156,930 @@ void btree::printAll() {
   pthread_mutex_unlock(&print_mtx);
 }
 
-void btree::future_insert(entry_key_t key, int tid, bool isDone = false){
-  if(local_fut == NULL){
-    local_fut = new future_Node[n_threads];
-  } else{
-    if(local_fut[tid].next == NULL){
-      //Create a new node next to the dummy head node.
-      future_Node *first_node = new future_Node();
-      first_node->keys[0] = key;
-      first_node->entry_count += 1;
-      first_node->prev = &(local_fut[tid]);
-      local_fut[tid].next = first_node;
-      local_fut_tail[tid].next = first_node;
-      local_fut[tid].entry_count += 1;
-      hash[tid].Insert(key, tid);
-      clflush((char *)this, CACHE_LINE_SIZE);
-      
-    } 
-    else if(local_fut[tid].next->entry_count == cardinality ){
-      //Create a new node and perform the evaluation on the previous node.
-      //Once evaluation is done, free the previous node and move the head node's next pointer to the current node who's next pointer is NULL
-      future_Node *new_node = new future_Node();
-
-      new_node->keys[0] = key;
-      new_node->entry_count += 1;
-      new_node->prev = &(local_fut[tid]);
-      new_node->next = local_fut[tid].next;
-      local_fut[tid].next->prev = new_node;
-      local_fut[tid].next = new_node;
-      local_fut[tid].entry_count += 1;
-
-      hash[tid].Insert(key, tid);
-
-      clflush((char *)this, CACHE_LINE_SIZE);
-    } 
-    else{
-      local_fut[tid].next->keys[local_fut[tid].next->entry_count] = key;
-      local_fut[tid].next->entry_count += 1;
-      hash[tid].Insert(key, tid);
-      
-      //flush 
-      uint64_t recd_ptr = (uint64_t)(&local_fut[tid].next->keys);
-      int remainder = recd_ptr % CACHE_LINE_SIZE;
-      bool do_flush = (remainder == 0) ||
-                ((((int)(remainder + sizeof(future_Node)) / CACHE_LINE_SIZE) == 1) &&
-                 ((remainder + sizeof(future_Node)) % CACHE_LINE_SIZE) != 0);
-      if(do_flush){
-        clflush((char *)local_fut[tid].next->keys, CACHE_LINE_SIZE);
-      } 
-    
+// Thread local futures. The head block is appended to only by its producer;
+// an append publishes the slot with a CAS on entry_count so an evaluator can
+// seal the head underneath it and take the keys written so far.
+// Every operation gets the next sequence number of its producer, which is
+// returned for future_sync.
+uint64_t btree::future_insert(entry_key_t key, int tid, bool isDone = false){
+  return future_append(key, (char *)key, FUT_INSERT, tid);
+}
+
+// ptr must not be NULL: a leaf ends at the first NULL pointer, so it would
+// hide every key after it. Use future_delete to remove a key. Nor may two
+// keys share a ptr: FAST readers take two neighbouring slots with the same
+// pointer for a shift in progress and skip one of them, so once the keys
+// end up next to each other in a leaf one of them goes missing. Point
+// several keys at one object through distinct handles instead. A batch
+// that gives two neighbouring keys one value fails an assert on apply;
+// other cases are not detected.
+uint64_t btree::future_upsert(entry_key_t key, char *ptr, int tid){
+  assert(ptr != NULL);
+  return future_append(key, ptr, FUT_UPSERT, tid);
+}
+
+uint64_t btree::future_delete(entry_key_t key, int tid){
+  return future_append(key, NULL, FUT_DELETE, tid);
+}
+
+uint64_t btree::future_append(entry_key_t key, char *ptr, int op, int tid){
+  // Issued only once the operation is in a linked block or in the tree, so
+  // future_applied_seq never runs ahead of it.
+  uint64_t seq = fut_seq[tid] + 1;
+
+  // Fold into this producer's earlier operation on the key, if any.
+  if(fut_bloom[tid].contains(key)){
+    op = future_collapse(key, op, tid);
+    if(op == FUT_DEAD){
+      __atomic_store_n(&fut_seq[tid], seq, __ATOMIC_RELEASE);
+      return seq;
+    }
+  }
+
+  if(fut_bypass && future_bypass(tid)){
+    future_direct(key, ptr, op, tid);
+    __atomic_store_n(&fut_seq[tid], seq, __ATOMIC_RELEASE);
+    return seq;
+  }
+
+  future_Node *head = local_fut[tid].next;
+
+  while(true){
+    if(head != NULL){
+      int n = __atomic_load_n(&head->entry_count, __ATOMIC_ACQUIRE);
+      if(n < cardinality){
+        head->keys[n] = key;
+        head->ptrs[n] = ptr;
+        head->ops[n] = op;
+        clflush((char *)&head->keys[n], sizeof(int64_t));
+        clflush((char *)&head->ptrs[n], sizeof(char *));
+        clflush((char *)&head->ops[n], sizeof(uint8_t));
+        fut_bloom[tid].insert(key);
+        hash[tid].Insert(key, (int64_t)ptr, (int64_t)head);
+
+        if(__atomic_compare_exchange_n(&head->entry_count, &n, n + 1, false,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+          __atomic_store_n(&fut_seq[tid], seq, __ATOMIC_RELEASE);
+          // A producer that never fills its head seals it itself once it is
+          // too old, the evaluators may be too busy to get to it.
+          bool stale = fut_max_stale_ns > 0 &&
+                       monotonic_ns() - head->opened_ns >= fut_max_stale_ns;
+          if((n + 1 == cardinality || stale) && future_seal(tid, head))
+            future_publish(tid, head);
+          return seq;
+        }
+        // Sealed by an evaluator, retry in a fresh block.
+        continue;
+      }
+    }
+
+    if(!future_reserve(tid)){
+      future_direct(key, ptr, op, tid);
+      __atomic_store_n(&fut_seq[tid], seq, __ATOMIC_RELEASE);
+      return seq;
+    }
+    head = future_push(tid);
+  }
+}
+
+// Apply an operation of producer tid to the tree right away.
+void btree::future_direct(entry_key_t key, char *ptr, int op, int tid){
+  if(op == FUT_DELETE)
+    btree_delete(key);
+  else
+    btree_insert_batch(&key, &ptr, 1);
+  // The index may still point at a cancelled slot for this key.
+  hash[tid].Remove(key);
+}
+
+// Whether producer tid's next operation may skip its buffer, see
+// fut_bypass. The first caller past the end of a window closes it and
+// decides for the next one from its contended leaf locks. Everything the
+// producer buffered before must be in the tree, so a direct operation never
+// overtakes a buffered one on the same key. Partitioned evaluators write
+// their ranges without leaf locks, so nothing bypasses them.
+bool btree::future_bypass(int tid){
+  if(fut_partitioned)
+    return false;
+
+  long now = monotonic_ns();
+  long start = __atomic_load_n(&fut_window, __ATOMIC_RELAXED);
+  if(now - start >= fut_control_ns &&
+     __atomic_compare_exchange_n(&fut_window, &start, now, false,
+                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+    long waits = __atomic_exchange_n(&fut_waits, 0, __ATOMIC_RELAXED);
+    // Scale to one fut_control_ns, the window may have been idle longer.
+    bool quiet = waits * fut_control_ns < (long)fut_bypass_waits * (now - start);
+    __atomic_store_n(&fut_direct, quiet ? 1 : 0, __ATOMIC_RELAXED);
+  }
+
+  if(!__atomic_load_n(&fut_direct, __ATOMIC_RELAXED))
+    return false;
+  return future_drained(tid);
+}
+
+// Resolve a new operation against the producer's buffered one on the same
+// key, so each key has at most one live operation per producer:
+//  - a write then a DELETE cancel each other when the tree does not hold
+//    the key, so nothing reaches the tree; if it does, the write may have
+//    overwritten it, and the DELETE stays
+//  - any other pair keeps only the newer operation
+// The older slot is cancelled only while its block is unclaimed. If an
+// evaluator is already applying it, wait until that block is released so
+// the two never reach the tree out of order. Returns the operation to
+// append, or FUT_DEAD if there is nothing left to do.
+int btree::future_collapse(entry_key_t key, int op, int tid){
+  // Looked up before the producer's lock, as it takes leaf locks. This
+  // producer's earlier operations on the key are all applied or still
+  // buffered by then, so only other producers can change the answer, and
+  // their order against ours is not defined anyway. Partitioned evaluators
+  // write without leaf locks, so there the DELETE is always kept.
+  bool absent = op == FUT_DELETE && !fut_partitioned && !btree_holds(key);
+
+  while(true){
+    int64_t value, tag;
+
+    fut_mtx[tid].lock();
+    if(!hash[tid].Lookup(key, &value, &tag)){
+      fut_mtx[tid].unlock();
+      return op;
+    }
+
+    // Blocks are unlinked under fut_mtx[tid] only after their index
+    // entries are gone, so the tagged block is alive here.
+    future_Node *node = (future_Node *)tag;
+    if(node->is_claimed){
+      int seen = local_fut[tid].entry_count;
+      fut_mtx[tid].unlock();
+
+      __atomic_add_fetch(&fut_waiters, 1, __ATOMIC_SEQ_CST);
+      futex_wait(&local_fut[tid].entry_count, seen);
+      __atomic_sub_fetch(&fut_waiters, 1, __ATOMIC_SEQ_CST);
+      continue;
+    }
+
+    int j = (__atomic_load_n(&node->entry_count, __ATOMIC_ACQUIRE) &
+             ~FUT_SEALED) - 1;
+    while(j >= 0 && (node->keys[j] != key || node->ops[j] == FUT_DEAD))
+      j--;
+    if(j < 0){
+      fut_mtx[tid].unlock();
+      return op;
+    }
+
+    int old = node->ops[j];
+    node->ops[j] = FUT_DEAD;
+    clflush((char *)&node->ops[j], sizeof(uint8_t));
+
+    if(old != FUT_DELETE && op == FUT_DELETE && absent){
+      hash[tid].RemoveIf(key, tag);
+      op = FUT_DEAD;
+    }
+    fut_mtx[tid].unlock();
+
+    // The index keeps the cancelled write visible until the new one is
+    // appended over it.
+    return op;
+  }
+}
+
+// Close a block to further appends. Returns false if it was already sealed
+// or holds nothing to evaluate.
+bool btree::future_seal(int tid, future_Node *node){
+  int n = __atomic_load_n(&node->entry_count, __ATOMIC_ACQUIRE);
+  // The time goes in before the sealing CAS publishes it, since
+  // future_oldest_age reads it as soon as it sees FUT_SEALED. A sealer
+  // that loses the race leaves it: the winner wrote its own time before
+  // its CAS, and the two are at most a retry apart.
+  do{
+    if((n & FUT_SEALED) || n == 0)
+      return false;
+    __atomic_store_n(&node->sealed_ns, monotonic_ns(), __ATOMIC_RELAXED);
+  }while(!__atomic_compare_exchange_n(&node->entry_count, &n, n | FUT_SEALED,
+                                      false, __ATOMIC_ACQ_REL,
+                                      __ATOMIC_ACQUIRE));
+
+  __atomic_add_fetch(&local_fut[tid].entry_count, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&fut_blocks, 1, __ATOMIC_SEQ_CST);
+  return true;
+}
+
+// Hand a freshly sealed block to the evaluators. Must be called without
+// fut_mtx[tid] held.
+void btree::future_publish(int tid, future_Node *node){
+  if(!fut_partitioned){
+    future_enqueue(future_home(tid), future_Task(tid, NULL, node->sealed_ns));
+    return;
+  }
+
+  fut_mtx[tid].lock();
+  node->is_claimed = true;
+  fut_mtx[tid].unlock();
+  // Sorted before the split, so every piece comes out sorted too.
+  future_sort(node);
+
+  pthread_rwlock_rdlock(&fut_part_lock);
+  future_route(tid, node, node);
+  pthread_rwlock_unlock(&fut_part_lock);
+}
+
+// Split the keys of src by evaluator range and queue one piece per owner.
+// block is the producer's block the keys came from. Caller must hold
+// fut_part_lock.
+void btree::future_route(int tid, future_Node *block, future_Node *src){
+  vector<future_Node *> pieces(eval_threads, (future_Node *)NULL);
+  int n = src->entry_count & ~FUT_SEALED;
+  int count = 0;
+
+  for(int k = 0; k < n; k++){
+    int e = upper_bound(fut_bounds, fut_bounds + fut_nbounds, src->keys[k]) -
+            fut_bounds;
+    future_Node *piece = pieces[e];
+    if(piece == NULL){
+      piece = pieces[e] = new future_Node();
+      piece->parent = block;
+      piece->epoch = fut_epoch;
+      count++;
+    }
+    piece->keys[piece->entry_count] = src->keys[k];
+    piece->ptrs[piece->entry_count] = src->ptrs[k];
+    piece->ops[piece->entry_count] = src->ops[k];
+    piece->entry_count++;
+  }
+
+  // Account for every piece before the first one can complete.
+  __atomic_add_fetch(&block->pending, count, __ATOMIC_SEQ_CST);
+  for(int e = 0; e < eval_threads; e++){
+    if(pieces[e] != NULL){
+      pieces[e]->entry_count |= FUT_SEALED;
+      future_enqueue(e, future_Task(tid, pieces[e], block->sealed_ns));
+    }
+  }
+  __atomic_add_fetch(&fut_routed, 1, __ATOMIC_RELAXED);
+}
+
+void btree::future_enqueue(int e, future_Task task){
+  future_Deque *q = &fut_tasks[e];
+
+  q->mtx.lock();
+  q->tasks.push_back(task);
+  __atomic_store_n(&q->size, (int)q->tasks.size(), __ATOMIC_RELAXED);
+  __atomic_store_n(&q->oldest, q->tasks.front().sealed_ns, __ATOMIC_RELAXED);
+  q->mtx.unlock();
+
+  future_wake();
+}
+
+// Wake the parked evaluators. The owner of a range may be any of them, so
+// all are woken; this only costs anything while the buffers are idle.
+void btree::future_wake(){
+  __atomic_add_fetch(&fut_signal, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&fut_parked, __ATOMIC_SEQ_CST) > 0)
+    futex_wake(&fut_signal, INT_MAX);
+}
+
+// Tell the evaluators that no more operations will be buffered. They drain
+// what is left and return from future_evaluate.
+void btree::future_shutdown(){
+  __atomic_store_n(&fut_shutdown, 1, __ATOMIC_SEQ_CST);
+  future_wake();
+  __atomic_add_fetch(&fut_resized, 1, __ATOMIC_SEQ_CST);
+  futex_wake(&fut_resized, INT_MAX);
+}
+
+// Evaluator that takes the blocks of producer tid and seals its idle head.
+int btree::future_home(int tid){
+  return tid % __atomic_load_n(&fut_active, __ATOMIC_RELAXED);
+}
+
+bool btree::future_adaptive(){
+  return eval_threads_min > 0 && eval_threads_min < eval_threads &&
+         !fut_partitioned;
+}
+
+// One sample of the evaluator controller, run by evaluator 0.
+void btree::future_control(){
+  int active = __atomic_load_n(&fut_active, __ATOMIC_RELAXED);
+  int depth = __atomic_load_n(&fut_blocks, __ATOMIC_SEQ_CST);
+  long age = future_oldest_age(monotonic_ns());
+
+  if(active < eval_threads &&
+     (depth > fut_grow_depth * active || age > fut_grow_age_ns)){
+    fut_calm = 0;
+    future_resize(active + 1);
+  }else if(active > eval_threads_min &&
+           depth <= fut_grow_depth * (active - 1) / 2 &&
+           age <= fut_grow_age_ns / 2){
+    if(++fut_calm >= FUT_SHRINK_SAMPLES){
+      fut_calm = 0;
+      future_resize(active - 1);
     }
+  }else{
+    fut_calm = 0;
+  }
+}
+
+// Blocks already queued on an evaluator that leaves the set are still
+// applied, by it or by a thief. Homes move with the new count, so the next
+// seal of each producer goes to an active evaluator.
+void btree::future_resize(int active){
+  __atomic_store_n(&fut_active, active, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&fut_resized, 1, __ATOMIC_SEQ_CST);
+  futex_wake(&fut_resized, INT_MAX);
+}
+
+// How long the oldest sealed block still linked has been waiting. Blocks are
+// sealed in list order, so it is the tail of some producer.
+long btree::future_oldest_age(long now){
+  long oldest = now;
+
+  for(int i = 0; i < n_threads; i++){
+    fut_mtx[i].lock();
+    future_Node *tail = local_fut_tail[i].next;
+    if(tail != NULL && !tail->is_done &&
+       (__atomic_load_n(&tail->entry_count, __ATOMIC_ACQUIRE) & FUT_SEALED) &&
+       tail->sealed_ns < oldest)
+      oldest = tail->sealed_ns;
+    fut_mtx[i].unlock();
   }
-  
-  //printf("Future insert returns. Entry Count: %d\n", local_fut[tid].entry_count);
+
+  return now - oldest;
 }
 
+// Take the oldest queued task: the front of our own deque, unless another
+// evaluator's front was sealed earlier, in which case that one is stolen.
+// A quiet producer's block is therefore never passed over for newer blocks
+// of busy ones. Ranges are owned in fut_partitioned mode, so nothing is
+// stolen there.
+bool btree::future_next_task(int tid, future_Task *task){
+  int victim = tid;
+  bool ret = false;
+
+  if(!fut_partitioned){
+    long oldest = __atomic_load_n(&fut_tasks[tid].oldest, __ATOMIC_RELAXED);
+    for(int e = 0; e < eval_threads; e++){
+      long front = __atomic_load_n(&fut_tasks[e].oldest, __ATOMIC_RELAXED);
+      if(front < oldest){
+        oldest = front;
+        victim = e;
+      }
+    }
+  }
+
+  // The fronts were read without the locks. If the victim has been emptied
+  // meanwhile, fall back to our own deque.
+  while(true){
+    future_Deque *q = &fut_tasks[victim];
+    q->mtx.lock();
+    if(!q->tasks.empty()){
+      *task = q->tasks.front();
+      q->tasks.pop_front();
+      ret = true;
+    }
+    __atomic_store_n(&q->size, (int)q->tasks.size(), __ATOMIC_RELAXED);
+    __atomic_store_n(&q->oldest,
+                     q->tasks.empty() ? LONG_MAX : q->tasks.front().sealed_ns,
+                     __ATOMIC_RELAXED);
+    q->mtx.unlock();
+
+    if(ret || victim == tid)
+      return ret;
+    victim = tid;
+  }
+}
+
+// Link a fresh head block. Caller must hold fut_mtx[tid].
+void btree::future_link(int tid, future_Node *node){
+  future_Node *old = local_fut[tid].next;
+
+  node->next = old;
+  node->prev = NULL;
+  if(old != NULL)
+    old->prev = node;
+  else
+    local_fut_tail[tid].next = node;
+  local_fut[tid].next = node;
+}
+
+// Caller must hold fut_mtx[tid].
+void btree::future_unlink(int tid, future_Node *node){
+  if(node->prev != NULL)
+    node->prev->next = node->next;
+  else
+    local_fut[tid].next = node->next;
+
+  if(node->next != NULL)
+    node->next->prev = node->prev;
+  else
+    local_fut_tail[tid].next = node->prev;
+}
+
+future_Node *btree::future_push(int tid){
+  future_Node *node = new future_Node();
+  future_Node *retired = NULL;
+
+  node->first_seq = fut_seq[tid] + 1;
+  node->opened_ns = monotonic_ns();
+
+  future_Bloom *bloom = &fut_bloom[tid];
+  bool rotate = false;
+
+  fut_mtx[tid].lock();
+  future_Node *old = local_fut[tid].next;
+  // The older filter can go once everything before the current generation
+  // is in the tree, see future_applied_seq. Right away when the producer is
+  // drained, otherwise after a generation's worth of blocks.
+  future_Node *oldest = local_fut_tail[tid].next;
+  bool drained = local_fut[tid].entry_count == 0 && (old == NULL || old->is_done);
+  if((drained || ++bloom->blocks >= bloom->gen_blocks) &&
+     (oldest == NULL || oldest->is_done || oldest->first_seq >= bloom->start))
+    rotate = true;
+  future_link(tid, node);
+  // An evaluator may have applied the old head while it was still the head,
+  // in which case it was left for us to free.
+  if(old != NULL && old->is_done){
+    future_unlink(tid, old);
+    retired = old;
+  }
+  fut_mtx[tid].unlock();
+
+  clflush((char *)&local_fut[tid].next, sizeof(future_Node *));
+  delete retired;
+
+  // Only this producer inserts, and only after future_push returns.
+  if(rotate){
+    bloom->cur ^= 1;
+    bloom->filter[bloom->cur]->clear();
+    bloom->start = node->first_seq;
+    bloom->blocks = 0;
+  }
+  return node;
+}
+
+// Take the oldest sealed block of a producer that nobody is applying yet.
+future_Node *btree::future_claim(int tid){
+  future_Node *node;
+
+  fut_mtx[tid].lock();
+  for(node = local_fut_tail[tid].next; node != NULL; node = node->prev){
+    if(node->is_claimed)
+      continue;
+    if(!(__atomic_load_n(&node->entry_count, __ATOMIC_ACQUIRE) & FUT_SEALED)){
+      node = NULL;
+      break;
+    }
+    node->is_claimed = true;
+    break;
+  }
+  fut_mtx[tid].unlock();
+
+  // Appends are unordered; the block is sorted once, by whoever owns it.
+  if(node != NULL)
+    future_sort(node);
+
+  return node;
+}
+
+// Drop cancelled slots and sort the rest by key. The network sorts keys
+// only, so every slot then finds its rank by binary search and its pointer
+// and operation are moved along. Caller owns the claimed block.
+void btree::future_sort(future_Node *node){
+  int n = node->entry_count & ~FUT_SEALED;
+  int live = 0;
+
+  for(int k = 0; k < n; k++){
+    if(node->ops[k] == FUT_DEAD)
+      continue;
+    node->keys[live] = node->keys[k];
+    node->ptrs[live] = node->ptrs[k];
+    node->ops[live] = node->ops[k];
+    live++;
+  }
+
+  entry_key_t sorted[cardinality];
+  char *ptrs[cardinality];
+  uint8_t ops[cardinality];
+  bool taken[cardinality];
+
+  memcpy(sorted, node->keys, live * sizeof(entry_key_t));
+  sortnet_sort(sorted, live);
+  for(int k = 0; k < live; k++)
+    taken[k] = false;
+  for(int k = 0; k < live; k++){
+    int r = lower_bound(sorted, sorted + live, node->keys[k]) - sorted;
+    while(taken[r])
+      r++;
+    taken[r] = true;
+    ptrs[r] = node->ptrs[k];
+    ops[r] = node->ops[k];
+  }
+
+  memcpy(node->keys, sorted, live * sizeof(entry_key_t));
+  memcpy(node->ptrs, ptrs, live * sizeof(char *));
+  memcpy(node->ops, ops, live * sizeof(uint8_t));
+  node->entry_count = live | FUT_SEALED;
+}
+
+void btree::future_apply(future_Node *node, bool with_lock){
+  int n = node->entry_count & ~FUT_SEALED;
+  entry_key_t keys[cardinality];
+  char *ptrs[cardinality];
+  int puts = 0;
+
+  for(int k = 0; k < n; k++){
+    if(node->ops[k] == FUT_DELETE){
+      btree_delete(node->keys[k]);
+      continue;
+    }
+    keys[puts] = node->keys[k];
+    ptrs[puts] = node->ptrs[k];
+    puts++;
+  }
+  btree_insert_batch(keys, ptrs, puts, with_lock);
+}
+
+// K-way merge of sorted blocks, applied in key order so consecutive keys
+// share the descent path and mostly land in the same leaf. Ties go to the
+// block claimed first, which keeps one producer's writes in order.
+void btree::future_apply_merged(vector<future_Node *> &blocks){
+  typedef pair<entry_key_t, int> head_t;
+  priority_queue<head_t, vector<head_t>, greater<head_t> > heads;
+  vector<int> pos(blocks.size(), 0);
+  vector<entry_key_t> run;
+  vector<char *> ptrs;
+
+  for(size_t b = 0; b < blocks.size(); b++){
+    if((blocks[b]->entry_count & ~FUT_SEALED) > 0)
+      heads.push(head_t(blocks[b]->keys[0], b));
+  }
+
+  while(!heads.empty()){
+    head_t h = heads.top();
+    heads.pop();
+
+    future_Node *node = blocks[h.second];
+    int k = pos[h.second];
+    if(node->ops[k] == FUT_DELETE){
+      btree_delete(h.first);
+    } else {
+      run.push_back(h.first);
+      ptrs.push_back(node->ptrs[k]);
+    }
+
+    if(++pos[h.second] < (node->entry_count & ~FUT_SEALED))
+      heads.push(head_t(node->keys[pos[h.second]], h.second));
+  }
+
+  if(!run.empty())
+    btree_insert_batch(run.data(), ptrs.data(), run.size());
+}
+
+// Drop an applied block. The head is still referenced by its producer, so it
+// is only marked done and freed by the next future_push.
+void btree::future_release(int tid, future_Node *node){
+  bool retire;
+  int n = node->entry_count & ~FUT_SEALED;
+
+  // The keys are in the tree now, so readers can stop looking for them in
+  // the buffer. A key rewritten by a newer block keeps its entry.
+  for(int k = 0; k < n; k++)
+    hash[tid].RemoveIf(node->keys[k], (int64_t)node);
+
+  fut_mtx[tid].lock();
+  retire = (node != local_fut[tid].next);
+  if(retire)
+    future_unlink(tid, node);
+  else
+    node->is_done = true;
+  __atomic_sub_fetch(&local_fut[tid].entry_count, 1, __ATOMIC_SEQ_CST);
+  __atomic_sub_fetch(&fut_blocks, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&fut_applied, 1, __ATOMIC_SEQ_CST);
+  fut_mtx[tid].unlock();
+
+  if(retire)
+    delete node;
+
+  if(__atomic_load_n(&fut_waiters, __ATOMIC_SEQ_CST) > 0){
+    futex_wake(&local_fut[tid].entry_count, INT_MAX);
+    futex_wake(&fut_blocks, INT_MAX);
+    futex_wake(&fut_applied, INT_MAX);
+  }
+
+  if(__atomic_load_n(&fut_callbacks[tid].size, __ATOMIC_SEQ_CST) > 0)
+    future_run_callbacks(tid);
+}
+
+// Highest sequence number of producer tid below which every operation has
+// reached the tree. Blocks are linked in issue order and only unlinked once
+// applied, so it is just below the oldest block still linked, or everything
+// issued if that block is the applied head.
+uint64_t btree::future_applied_seq(int tid){
+  uint64_t applied;
+
+  fut_mtx[tid].lock();
+  future_Node *oldest = local_fut_tail[tid].next;
+  if(oldest != NULL && !oldest->is_done)
+    applied = oldest->first_seq - 1;
+  else
+    applied = __atomic_load_n(&fut_seq[tid], __ATOMIC_ACQUIRE);
+  fut_mtx[tid].unlock();
+
+  return applied;
+}
+
+// Wait until producer tid's operations up to seq, by default all of those
+// issued so far, are applied to the tree. A partially filled head is sealed
+// right away instead of waiting for it to go idle, and outside partitioned
+// mode the caller applies the producer's blocks itself while they are not
+// claimed, so it returns without evaluators running. Otherwise it sleeps
+// until the next release. Returns the applied sequence number.
+uint64_t btree::future_sync(int tid, uint64_t seq){
+  uint64_t issued = __atomic_load_n(&fut_seq[tid], __ATOMIC_ACQUIRE);
+  if(seq > issued)
+    seq = issued;
+
+  while(true){
+    int gen = __atomic_load_n(&fut_applied, __ATOMIC_SEQ_CST);
+    uint64_t applied = future_applied_seq(tid);
+    if(applied >= seq)
+      return applied;
+
+    future_Node *head = NULL;
+    fut_mtx[tid].lock();
+    if(local_fut[tid].next != NULL && local_fut[tid].next->first_seq <= seq &&
+       future_seal(tid, local_fut[tid].next))
+      head = local_fut[tid].next;
+    fut_mtx[tid].unlock();
+    // Still linked until released, so safe to use after unlocking.
+    if(head != NULL)
+      future_publish(tid, head);
+
+    if(!fut_partitioned && future_help(tid) > 0)
+      continue;
+    if(head != NULL)
+      continue;
+
+    __atomic_add_fetch(&fut_waiters, 1, __ATOMIC_SEQ_CST);
+    futex_wait(&fut_applied, gen);
+    __atomic_sub_fetch(&fut_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+// Buffer an insert and return a token to poll or wait on, instead of
+// blocking until it is applied.
+future_Token btree::future_insert_async(entry_key_t key, int tid){
+  return future_Token(this, tid, future_insert(key, tid));
+}
+
+// Buffer an insert and call done once it is in the tree.
+void btree::future_insert_async(entry_key_t key, int tid,
+                                std::function<void()> done){
+  future_on_applied(tid, future_insert(key, tid), done);
+}
+
+// Call done once producer tid's operations up to seq are in the tree. It
+// runs on the thread that releases the last block involved, usually an
+// evaluator, so it should be short; if seq is already applied it runs right
+// away on the caller.
+void btree::future_on_applied(int tid, uint64_t seq,
+                              std::function<void()> done){
+  future_Callbacks *c = &fut_callbacks[tid];
+
+  c->mtx.lock();
+  std::deque<std::pair<uint64_t, std::function<void()> > >::iterator it =
+      c->pending.end();
+  while(it != c->pending.begin() && (it - 1)->first > seq)
+    --it;
+  c->pending.insert(it, std::make_pair(seq, done));
+  __atomic_store_n(&c->size, (int)c->pending.size(), __ATOMIC_SEQ_CST);
+  c->mtx.unlock();
+
+  // The block may have been released before the callback was queued.
+  future_run_callbacks(tid);
+}
+
+// Run the callbacks of producer tid whose operations have been applied.
+void btree::future_run_callbacks(int tid){
+  future_Callbacks *c = &fut_callbacks[tid];
+  vector<std::function<void()> > ready;
+  uint64_t applied = future_applied_seq(tid);
+
+  c->mtx.lock();
+  while(!c->pending.empty() && c->pending.front().first <= applied){
+    ready.push_back(c->pending.front().second);
+    c->pending.pop_front();
+  }
+  __atomic_store_n(&c->size, (int)c->pending.size(), __ATOMIC_SEQ_CST);
+  c->mtx.unlock();
+
+  for(size_t i = 0; i < ready.size(); i++)
+    ready[i]();
+}
+
+bool future_Token::ready(){
+  return bt->future_applied_seq(tid) >= seq;
+}
+
+// Wait until the operation is in the tree, see future_sync.
+void future_Token::wait(){
+  bt->future_sync(tid, seq);
+}
+
+// future_sync for every producer, up to what each had issued on entry.
+void btree::future_sync_all(){
+  vector<uint64_t> issued(n_threads);
+
+  for(int i = 0; i < n_threads; i++)
+    issued[i] = __atomic_load_n(&fut_seq[i], __ATOMIC_ACQUIRE);
+  for(int i = 0; i < n_threads; i++)
+    future_sync(i, issued[i]);
+}
+
+// Enforce fut_thread_cap and fut_global_cap before a producer opens another
+// block. Returns false when the key should go to the tree directly.
+bool btree::future_reserve(int tid){
+  if(fut_help_depth > 0 && !fut_partitioned){
+    while(__atomic_load_n(&local_fut[tid].entry_count, __ATOMIC_SEQ_CST) >
+              fut_help_depth &&
+          future_help(tid) > 0)
+      ;
+  }
+
+  while(true){
+    int local = __atomic_load_n(&local_fut[tid].entry_count, __ATOMIC_SEQ_CST);
+    int global = __atomic_load_n(&fut_blocks, __ATOMIC_SEQ_CST);
+    bool over_local = (fut_thread_cap > 0 && local >= fut_thread_cap);
+    bool over_global = (fut_global_cap > 0 && global >= fut_global_cap);
+
+    if(!over_local && !over_global)
+      return true;
+
+    // Only the owning evaluator may write a range, so partitioned mode
+    // always blocks.
+    int policy = fut_partitioned ? FUT_BLOCK : fut_overflow;
+
+    if(policy == FUT_DIRECT)
+      return false;
+
+    if(policy == FUT_HELP){
+      if(future_help(tid) > 0)
+        continue;
+      // All of our sealed blocks are already being applied, wait for them.
+    }
+
+    __atomic_add_fetch(&fut_waiters, 1, __ATOMIC_SEQ_CST);
+    if(over_local)
+      futex_wait(&local_fut[tid].entry_count, local);
+    else
+      futex_wait(&fut_blocks, global);
+    __atomic_sub_fetch(&fut_waiters, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+// Apply up to fut_merge_way of producer tid's oldest unclaimed sealed blocks
+// from the calling thread, as one sorted run like an evaluator would.
+// Returns how many blocks were applied.
+int btree::future_help(int tid){
+  vector<future_Node *> blocks;
+
+  while((int)blocks.size() < fut_merge_way){
+    future_Node *node = future_claim(tid);
+    if(node == NULL)
+      break;
+    blocks.push_back(node);
+  }
+
+  if(blocks.empty())
+    return 0;
+  if(blocks.size() == 1)
+    future_apply(blocks[0]);
+  else
+    future_apply_merged(blocks);
+
+  for(size_t b = 0; b < blocks.size(); b++)
+    future_release(tid, blocks[b]);
+  return (int)blocks.size();
+}
+
+// True once every key a producer buffered has reached the tree.
+bool btree::future_drained(int tid){
+  bool drained;
+
+  fut_mtx[tid].lock();
+  future_Node *head = local_fut[tid].next;
+  drained = (local_fut[tid].entry_count == 0) &&
+            (head == NULL || head->is_done ||
+             (head->entry_count & ~FUT_SEALED) == 0);
+  fut_mtx[tid].unlock();
+
+  return drained;
+}
+
+// Evaluators form a work-stealing pool: any of them may apply any
+// producer's sealed blocks, so one hot producer keeps all of them busy.
 void btree::future_evaluate(btree *bt, int tid){
-    //mutli-threaded Future Evaluate
-    //printf("Future Evaluate\n");
-    int prod_to_cons;
-    do{
-        if(local_fut[tid].entry_count == 0){
-            //std::this_thread::sleep_for (std::chrono::microseconds(1000));
-            continue;
-        } else{
-            if(tid == 0){
-                prod_to_cons = ((n_threads/eval_threads)+(n_threads%eval_threads));
-                future_evaluate_execute(bt, tid, prod_to_cons);
-            }else{
-                prod_to_cons = (n_threads/eval_threads);
-                future_evaluate_execute(bt, tid, prod_to_cons);
+    vector<int> seen(n_threads, 0);
+    int rebalanced = -FUT_REBALANCE;
+    int spins = 0;
+    bool control = (tid == 0 && bt->future_adaptive());
+    long next_sample = 0;
+    future_Task task;
+
+    while(true){
+        // Read before looking for work, so a block sealed after this point
+        // makes the futex wait below return at once.
+        int signal = __atomic_load_n(&bt->fut_signal, __ATOMIC_SEQ_CST);
+        int resized = __atomic_load_n(&bt->fut_resized, __ATOMIC_SEQ_CST);
+        bool shutdown = __atomic_load_n(&bt->fut_shutdown, __ATOMIC_SEQ_CST);
+        bool pending = false;
+
+        if(control){
+            long now = monotonic_ns();
+            if(now >= next_sample){
+                bt->future_control();
+                next_sample = now + fut_control_ns;
             }
         }
-        for(int i = tid; i < n_threads; i++){
-            if(local_fut[i].is_done){
-                bt->is_Done = true;
+
+        // Out of the active set: finish what was queued here before the
+        // shrink, then sleep until the set grows back or we shut down.
+        if(!shutdown && tid >= __atomic_load_n(&bt->fut_active, __ATOMIC_SEQ_CST)){
+            if(__atomic_load_n(&bt->fut_tasks[tid].size, __ATOMIC_RELAXED) > 0 &&
+               bt->future_next_task(tid, &task)){
+                if(task.node != NULL)
+                    bt->future_evaluate_piece(task);
+                else
+                    future_evaluate_execute(bt, tid, task.tid);
+                continue;
             }
+            futex_wait(&bt->fut_resized, resized);
+            continue;
         }
-    }while(!bt->is_Done);
+
+        // Evaluator 0 keeps the ranges in line with how the tree has grown.
+        if(fut_partitioned && tid == 0 &&
+           __atomic_load_n(&bt->fut_routed, __ATOMIC_RELAXED) - rebalanced >=
+               FUT_REBALANCE){
+            rebalanced = __atomic_load_n(&bt->fut_routed, __ATOMIC_RELAXED);
+            bt->future_partition();
+        }
+
+        if(bt->future_next_task(tid, &task)){
+            if(task.node != NULL)
+                bt->future_evaluate_piece(task);
+            else
+                future_evaluate_execute(bt, tid, task.tid);
+            spins = 0;
+            continue;
+        }
+
+        if(bt->future_seal_idle(tid, seen.data(), &pending)){
+            spins = 0;
+            continue;
+        }
+
+        if(shutdown){
+            bool done = true;
+            for(int i = 0; i < n_threads; i++){
+                if(!bt->future_drained(i)){
+                    done = false;
+                    break;
+                }
+            }
+            if(done)
+                break;
+        }
+
+        if(++spins < fut_spin){
+            cpu_pause();
+            continue;
+        }
+        spins = 0;
+
+        // Nothing queued. Sleep until a block is sealed, or only for a while
+        // if a head still has to be sealed, others are draining blocks we
+        // have to wait out before returning, or the controller has to keep
+        // sampling to shrink the set.
+        bool timed = pending || shutdown;
+        long idle_ns = fut_idle_ns;
+        if(fut_max_stale_ns > 0)
+            idle_ns = std::min(idle_ns, fut_max_stale_ns);
+        if(control && __atomic_load_n(&bt->fut_active, __ATOMIC_RELAXED) >
+                          eval_threads_min){
+            timed = true;
+            idle_ns = std::min(idle_ns, fut_control_ns);
+        }
+        struct timespec idle;
+        idle.tv_sec = idle_ns / 1000000000;
+        idle.tv_nsec = idle_ns % 1000000000;
+        __atomic_add_fetch(&bt->fut_parked, 1, __ATOMIC_SEQ_CST);
+        futex_wait(&bt->fut_signal, signal, timed ? &idle : NULL);
+        __atomic_sub_fetch(&bt->fut_parked, 1, __ATOMIC_SEQ_CST);
+    }
+
+    for(int i = 0; i < n_threads; i++)
+        bt->local_fut[i].is_done = true;
+    __atomic_store_n(&bt->is_Done, true, __ATOMIC_RELEASE);
 }
 
 /*Singly linked list based
@@ -1248,32 +3119,132 @@ void btree::future_evaluate_execute(btree *bt, int tid, int total_t){
 }*/
 
 //Using Tail Pointer.
-void btree::future_evaluate_execute(btree *bt, int tid, int total_t){
-  //printf("Evaluate Execute.\n");
-  for(int i = (tid*total_t); i < ((tid+1) * total_t); i++){
-    future_Node *last_node = NULL;  
-    //printf("Last Node not NULL\n");
-    while(last_node != bt->local_fut[i].next){
-      future_Node *tail_node = bt->local_fut_tail[i].next;
-        for(int k = 0; k <= tail_node->entry_count; k++){
-          bt->btree_insert(tail_node->keys[k], (char *)tail_node->keys[k]);
-          //bt->hash[i].Remove(tail_node->keys[k]);
-        }
+//Apply the oldest sealed block of producer i that nobody has claimed yet,
+//together with up to fut_merge_way - 1 more blocks queued behind it, as one
+//sorted run.
+void btree::future_evaluate_execute(btree *bt, int tid, int i){
+  vector<future_Node *> blocks;
+  vector<int> owners;
+  future_Task task;
+
+  while(true){
+    future_Node *node = bt->future_claim(i);
+    if(node != NULL){
+      blocks.push_back(node);
+      owners.push_back(i);
+    }
+    // Pieces are only queued in fut_partitioned mode, which never gets here.
+    if((int)blocks.size() >= fut_merge_way || !bt->future_next_task(tid, &task))
+      break;
+    i = task.tid;
+  }
 
-        last_node = tail_node->prev;
-        bt->local_fut_tail[i].next = tail_node->prev;
-        bt->local_fut[i].entry_count -= 1;
-        //Remove the key from Hash Table
-        
-        delete tail_node;
+  if(blocks.empty())
+    return;
+  if(blocks.size() == 1)
+    bt->future_apply(blocks[0]);
+  else
+    bt->future_apply_merged(blocks);
 
-        
+  for(size_t b = 0; b < blocks.size(); b++)
+    bt->future_release(owners[b], blocks[b]);
+}
 
-        if(bt->local_fut[i].entry_count == 0){
-          bt->local_fut[i].is_done = true;
-          break;
-        }
-      }
+// Apply a routed piece without leaf locks: its range belongs to this
+// evaluator alone. A piece routed under older ranges is split again.
+void btree::future_evaluate_piece(future_Task task){
+  future_Node *piece = task.node;
+  future_Node *block = piece->parent;
+
+  pthread_rwlock_rdlock(&fut_part_lock);
+  if(piece->epoch != fut_epoch)
+    future_route(task.tid, block, piece);
+  else
+    future_apply(piece, false);
+  pthread_rwlock_unlock(&fut_part_lock);
+
+  delete piece;
+  if(__atomic_sub_fetch(&block->pending, 1, __ATOMIC_SEQ_CST) == 0)
+    future_release(task.tid, block);
+}
+
+// Recompute the evaluator ranges as quantiles of the inner-node separators,
+// so each range covers about the same number of leaves. A separator is a
+// leaf boundary for good, so every range is a disjoint run of leaves.
+void btree::future_partition(){
+  vector<entry_key_t> seps;
+  entry_key_t keys[cardinality];
+  char *ptrs[cardinality];
+  page *level = (page *)root;
+
+  while(level->hdr.leftmost_ptr != NULL){
+    // Copied like a leaf, so a node shifting under a split cannot hand
+    // over a torn separator.
+    for(page *p = level; p != NULL; p = p->hdr.sibling_ptr){
+      int n = p->scan(LONG_MIN, keys, ptrs);
+      seps.insert(seps.end(), keys, keys + n);
+    }
+    level = level->hdr.leftmost_ptr;
   }
-  //printf("Evaluate Execute Returns\n");
-}
\ No newline at end of file
+  sort(seps.begin(), seps.end());
+  seps.erase(unique(seps.begin(), seps.end()), seps.end());
+
+  entry_key_t *bounds = new entry_key_t[eval_threads];
+  int nbounds = 0;
+  for(int e = 1; e < eval_threads && !seps.empty(); e++){
+    entry_key_t b = seps[(size_t)e * seps.size() / eval_threads];
+    if(nbounds == 0 || b > bounds[nbounds - 1])
+      bounds[nbounds++] = b;
+  }
+
+  // Wait for the pieces in flight under the old ranges.
+  pthread_rwlock_wrlock(&fut_part_lock);
+  entry_key_t *old = fut_bounds;
+  fut_bounds = bounds;
+  fut_nbounds = nbounds;
+  fut_epoch++;
+  pthread_rwlock_unlock(&fut_part_lock);
+
+  delete[] old;
+}
+
+// Seal the partially filled heads of this evaluator's home producers once a
+// producer has stopped appending for a whole pass, so bursts are not cut
+// into tiny blocks, or once a head is older than fut_max_stale_ns. Returns
+// true if anything was sealed, and sets *pending if a head was left open
+// because its producer is still appending.
+bool btree::future_seal_idle(int tid, int *seen, bool *pending){
+  bool sealed = false;
+  long now = fut_max_stale_ns > 0 ? monotonic_ns() : 0;
+
+  for(int i = 0; i < n_threads; i++){
+    future_Node *head = NULL;
+
+    if(future_home(i) != tid)
+      continue;
+
+    fut_mtx[i].lock();
+    if(local_fut[i].next != NULL){
+      int n = __atomic_load_n(&local_fut[i].next->entry_count,
+                              __ATOMIC_ACQUIRE);
+      bool idle = (local_fut[i].entry_count == 0 && n == seen[i]);
+      bool stale = (fut_max_stale_ns > 0 &&
+                    now - local_fut[i].next->opened_ns >= fut_max_stale_ns);
+      if((idle || stale) && future_seal(i, local_fut[i].next))
+        head = local_fut[i].next;
+      else if(n != 0 && !(n & FUT_SEALED))
+        *pending = true;
+      if(local_fut[i].entry_count == 0)
+        seen[i] = n;
+    }
+    fut_mtx[i].unlock();
+
+    // Still linked until released, so safe to use after unlocking.
+    if(head != NULL){
+      future_publish(i, head);
+      sealed = true;
+    }
+  }
+
+  return sealed;
+}
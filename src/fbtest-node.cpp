@@ -40,7 +40,6 @@ int main(int argc, char **argv){
     }
 
     n_threads = n_thrds;
-    T_S = num_data;
     eval_threads = 4;
     fBtree *bt;
     bt = new fBtree();
@@ -102,6 +101,8 @@ int main(int argc, char **argv){
         auto e = std::async(std::launch::async, &fBtree::fut_Evaluate, (*bt), bt, e_tid);
         futures.push_back(move(e));
     }  
+    // Producers are done, idle evaluators can return.
+    bt->fut_Shutdown();
 
     /*for(auto &&f : futures)
         if(f.valid())
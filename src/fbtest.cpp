@@ -17,10 +17,11 @@ int main(int argc, char **argv){
     //Parsing arguments
     int num_data = 0;
     int n_thrds = 1;
+    int e_thrds = 1;
     char *input_path = (char *)std::string("../sample_input.txt").data();
 
     int c;
-    while((c = getopt(argc, argv, "n:w:t:i:")) != -1){
+    while((c = getopt(argc, argv, "n:w:t:e:m:bi:")) != -1){
         switch (c)
         {
         case 'n':
@@ -32,6 +33,15 @@ int main(int argc, char **argv){
         case 't':
             n_thrds = atoi(optarg);
             break;
+        case 'e':
+            e_thrds = atoi(optarg);
+            break;
+        case 'm':
+            eval_threads_min = atoi(optarg);
+            break;
+        case 'b':
+            fut_bypass = true;
+            break;
         case 'i':
             input_path = optarg;
         default:
@@ -40,8 +50,7 @@ int main(int argc, char **argv){
     }
 
     n_threads = n_thrds;
-    T_S = num_data;
-    eval_threads = 1;
+    eval_threads = e_thrds;
     btree *bt;
     bt = new btree();
 
@@ -99,9 +108,11 @@ int main(int argc, char **argv){
 
     clock_gettime(CLOCK_MONOTONIC, &start);
     for(int e_tid = 0; e_tid < eval_threads; e_tid++){       
-        auto e = std::async(std::launch::async, &btree::future_evaluate, (*bt), bt, e_tid);
+        auto e = std::async(std::launch::async, &btree::future_evaluate, bt, bt, e_tid);
         futures.push_back(move(e));
     }  
+    // Producers are done, let the evaluators drain the buffers and return.
+    bt->future_shutdown();
 
     /*for(auto &&f : futures)
         if(f.valid())
@@ -11,7 +11,14 @@
 #include <unistd.h>
 #include <vector>
 #include <atomic>
+#include <algorithm>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "hash.h"
+#include "sortnet.h"
 
 
 #define PAGESIZE 512  //Node size leaf+inner+futures
@@ -22,9 +29,28 @@
 #define MAX_THREAD 10
 int n_threads, eval_threads;
 
+// An evaluator with nothing to do spins this many times, then parks until a
+// producer links a new block. While one of its producers has a partially
+// filled head it wakes up after fut_idle_ns anyway, to take the head once
+// the producer stops appending.
+int fut_spin = 1024;
+long fut_idle_ns = 1000000;
+
+// entry_count bit set once a future_Node is closed to further appends
+#define FUT_SEALED (1 << 30)
+
 void do_flush(const void* addr, size_t len);
 
 static inline void cpu_pause() { __asm__ volatile("pause" ::: "memory"); }
+
+static inline void futex_wait(int *addr, int val,
+                              const struct timespec *timeout = NULL) {
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static inline void futex_wake(int *addr, int n) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
 static inline unsigned long read_tsc(void) {
   unsigned long var;
   unsigned int hi, lo;
@@ -110,6 +136,7 @@ class future_Node{
         int64_t keys[cardinality];
         int entry_count;
         bool is_done;
+        bool is_claimed;
         future_Node *next;
         future_Node *prev;
 
@@ -117,6 +144,7 @@ class future_Node{
             keys[0] = NULL;
             entry_count = 0;
             is_done = false;
+            is_claimed = false;
             next = NULL;
             prev = NULL;
         }
@@ -132,6 +160,10 @@ class fBtree{
         future_Node *local_fut;
         future_Node *local_fut_tail;
         HashMapTable *hash;
+        std::mutex *fut_mtx; // per-producer, guards the block list links
+        int fut_signal;     // bumped whenever a producer links a block
+        int fut_parked;     // evaluators asleep on fut_signal
+        int fut_shutdown;   // set once no more keys will be buffered
 
     public:
         fBtree();
@@ -154,7 +186,11 @@ class fBtree{
         //void future_Evaluate(fBtree *, int);
         void fut_Evaluate(fBtree *, int);
         void fut_Evaluate_execute(fBtree *, int, int);
-        void future_evaluate_execute(fBtree *, int, int);
+        int future_evaluate_execute(fBtree *, int, int *, bool *);
+        void fut_Push(int);
+        int fut_Apply(int, int *, bool *);
+        void fut_Wake();
+        void fut_Shutdown();
 
         friend class page;
 };
@@ -214,6 +250,47 @@ class page{
             return count;
         }
 
+        inline bool remove_key(int64_t key){
+            //Set the switch_counter
+            if(IS_FORWARD(gnode.switch_counter))
+                ++gnode.switch_counter;
+
+            bool shift = false;
+            int i;
+            for(i = 0; records[i].ptr != NULL; ++i){
+                if(!shift && records[i].keys == key){
+                    records[i].ptr = (i == 0) ? (char *)gnode.leftmost_ptr : records[i - 1].ptr;
+                    shift = true;
+                }
+
+                if(shift){
+                    records[i].keys = records[i + 1].keys;
+                    records[i].ptr = records[i + 1].ptr;
+
+                    //flush
+                    uint64_t records_ptr = (uint64_t)(&records[i]);
+                    int remainder = records_ptr % CACHELINE_SIZE;
+                    bool do_flush = (remainder == 0) ||
+                                    ((((int)(remainder + sizeof(entry)) / CACHELINE_SIZE) == 1) &&
+                                    ((remainder + sizeof(entry)) % CACHELINE_SIZE) != 0);
+                    if(do_flush)
+                        clflush((char *)records_ptr, CACHELINE_SIZE);
+                }
+            }
+
+            if(shift)
+                --gnode.last_index;
+            return shift;
+        }
+
+        bool remove(int64_t key){
+            gnode.mtx->lock();
+            bool ret = remove_key(key);
+            gnode.mtx->unlock();
+
+            return ret;
+        }
+
         inline void insert_key(int64_t key, char *ptr, int *num_entries, bool flush = true, bool update_last_index = true){
             if(!IS_FORWARD(gnode.switch_counter))
                 ++gnode.switch_counter;
@@ -355,7 +432,7 @@ class page{
                 }
 
                 //set a new root or insert the split key to the parent
-                if(bt->root = (char*)this){
+                if(bt->root == (char *)this){
                     page *new_root = new page((page*)this, split_key, sibling, gnode.level+1);
                     bt->setNewRoot((char *)new_root);
 
@@ -369,82 +446,98 @@ class page{
         }
 
         //Node-based insertion.
-        page *node_store(fBtree *fb, int64_t fut_rcd[], bool with_lock, page *invalide_sibling = NULL){
-            //printf("Global Node Store\n");
-            if (with_lock) {
-                gnode.mtx->lock(); // Lock the write lock
-                }
-                if (gnode.is_deleted) {
-                if (with_lock) {
-                    gnode.mtx->unlock();
-                }
+        // Write a whole slot with one 16-byte store, so a reader never pairs
+        // a key with another slot's pointer while slots move several steps.
+        static inline void store_entry(entry *e, int64_t key, char *ptr){
+#ifdef __SSE2__
+            _mm_store_si128((__m128i *)e, _mm_set_epi64x((long long)ptr, key));
+#else
+            e->ptr = ptr;
+            e->keys = key;
+#endif
+        }
 
-                return NULL;
+        // Node-based insertion of a sorted future block. Takes the part of
+        // the block that belongs to this node (below both the parent's
+        // separator and the sibling's first key), overwrites keys already present, and merges the new ones in
+        // a single right-to-left pass with one flush of the touched range.
+        // A full node is split by a regular store of the next key. Returns
+        // how many keys were consumed; 0 means the node was deleted and the
+        // caller has to descend again.
+        int node_store(fBtree *fb, int64_t fut_rcd[], int num, int64_t bound, bool with_lock){
+            if(with_lock)
+                gnode.mtx->lock();
+            if(gnode.is_deleted){
+                if(with_lock)   gnode.mtx->unlock();
+                return 0;
             }
-            //To Do:
-            // Simply implement it as linkedlist.
-            if(gnode.sibling_ptr && (gnode.sibling_ptr != invalide_sibling)){
-                if(fut_rcd[0] > gnode.sibling_ptr->records[0].keys 
-                || fut_rcd[0] > gnode.sibling_ptr->records[gnode.last_index].keys){
-                    //printf("Key is greater than sibling's key\n");
-                    if(with_lock)
-                        gnode.mtx->unlock();
-                    return gnode.sibling_ptr->node_store(fb, fut_rcd, invalide_sibling);
+
+            if(gnode.sibling_ptr){
+                int64_t first = gnode.sibling_ptr->records[0].keys;
+                if(fut_rcd[0] >= first){
+                    if(with_lock)   gnode.mtx->unlock();
+                    return gnode.sibling_ptr->node_store(fb, fut_rcd, num, bound, with_lock);
                 }
+                //Split not yet in the parent
+                if(first < bound)
+                    bound = first;
             }
+            int m = std::lower_bound(fut_rcd, fut_rcd + num, bound) - fut_rcd;
 
             register int num_entries = count();
-            
-            page *new_sibling = new page(gnode.level);
-
-            int sibling_cnt = 0;
-
-            for (int i = 0; i < cardinality; i++){
-                std::swap(new_sibling->records[i].keys, fut_rcd[i]);
-                char *ptr = (char *)fut_rcd[i];
-                std::swap(new_sibling->records[i].ptr, ptr);
-                clflush((char *)&(new_sibling->records[i]), sizeof(entry));
-            }//till here
-
-            if(gnode.sibling_ptr != NULL){
-                new_sibling->gnode.sibling_ptr = gnode.sibling_ptr;
-                clflush((char *)new_sibling, sizeof(page));
-
-                gnode.sibling_ptr = (page *)new_sibling;
-                clflush((char *)&gnode, sizeof(gnode));
-
-            } else{
-                gnode.sibling_ptr = (page *)new_sibling;
-                clflush((char *)&gnode, sizeof(gnode));
+            int room = cardinality - 1 - num_entries;
+            int64_t add[cardinality];
+            int t = 0, used = 0, r = 0;
+
+            while(used < m){
+                int j = used;
+                while(j + 1 < m && fut_rcd[j + 1] == fut_rcd[j])
+                    ++j;
+
+                while(r < num_entries && records[r].keys < fut_rcd[j])
+                    ++r;
+                if(r < num_entries && records[r].keys == fut_rcd[j]){
+                    records[r].ptr = (char *)fut_rcd[j];
+                    clflush((char *)&records[r].ptr, sizeof(char *));
+                } else{
+                    if(t == room)
+                        break;
+                    add[t++] = fut_rcd[j];
+                }
+                used = j + 1;
             }
 
-            //set to NULL
-            if(IS_FORWARD(gnode.switch_counter))
-                gnode.switch_counter += 2;
-            else
-                ++gnode.switch_counter;
-
-            register int m = (int)ceil(num_entries/2);
-            records[m].ptr = NULL;
-            clflush((char *)&records[m], sizeof(entry));
+            if(t > 0){
+                if(!IS_FORWARD(gnode.switch_counter))
+                    ++gnode.switch_counter;
 
-            gnode.last_index = m -1;
-            clflush((char *)&gnode.last_index, sizeof(int16_t));
+                int src = num_entries - 1, d = num_entries + t - 1, a = t - 1;
+                records[d + 1].ptr = NULL;
+                while(a >= 0){
+                    if(src >= 0 && records[src].keys > add[a]){
+                        store_entry(&records[d], records[src].keys, records[src].ptr);
+                        --src;
+                    } else{
+                        store_entry(&records[d], add[a], (char *)add[a]);
+                        --a;
+                    }
+                    --d;
+                }
+                clflush((char *)&records[d + 1], (num_entries + t - d) * sizeof(entry));
 
-            num_entries = gnode.last_index+1;
+                gnode.last_index = num_entries + t - 1;
+                clflush((char *)&gnode.last_index, sizeof(int16_t));
+            }
 
-            //set a new root or insert the split key to the parent
-            if(fb->root = (char*)this){
-                page *new_root = new page((page*)this, new_sibling->records[0].keys, new_sibling, gnode.level+1);
-                fb->setNewRoot((char *)new_root);
+            if(with_lock)
+                gnode.mtx->unlock();
 
-                if(with_lock)
-                    gnode.mtx->unlock();
-            } else{
-                    if(with_lock)   gnode.mtx->unlock();
-                    fb->fbtree_insert_internal(NULL, new_sibling->records[0].keys, (char *)new_sibling, gnode.level+1);
+            if(used == 0){
+                if(!store(fb, NULL, fut_rcd[0], (char *)fut_rcd[0], true, with_lock))
+                    return 0;
+                used = 1;
             }
-            return new_sibling;
+            return used;
         }
 
         void linear_search_range(int64_t min, int64_t max, unsigned long *buf){
@@ -649,6 +742,10 @@ fBtree::fBtree(){
     local_fut = (future_Node *)new future_Node[n_threads];
     local_fut_tail = (future_Node *) new future_Node[n_threads];
     hash = (HashMapTable *)new HashMapTable[n_threads];
+    fut_mtx = new std::mutex[n_threads];
+    fut_signal = 0;
+    fut_parked = 0;
+    fut_shutdown = 0;
 }
 
 void fBtree::setNewRoot(char *new_root){
@@ -658,6 +755,13 @@ void fBtree::setNewRoot(char *new_root){
 }
 
 char *fBtree::fbtree_search(int64_t key){
+    //Keys still in a per-thread future are newer than the tree.
+    int64_t buffered, tag;
+    for(int i = 0; i < n_threads; i++){
+        if(hash[i].Lookup(key, &buffered, &tag))
+            return (char *)buffered;
+    }
+
     page *p = (page *)root;
 
     while(p->gnode.leftmost_ptr != NULL){
@@ -672,8 +776,6 @@ char *fBtree::fbtree_search(int64_t key){
         }
     }
 
-    //TODO: Add the search mechanism for per-thread futures as well.
-
     if(!t){
         printf("NOT FOUND %lu, t = %x\n", key, t);
         return NULL;
@@ -685,74 +787,70 @@ char *fBtree::fbtree_search(int64_t key){
 
     
 //Thread Local Futures linked list
+//Only the producer appends to its head block. An append publishes the slot
+//with a CAS on entry_count, so an evaluator can seal a partially filled head
+//underneath it and take the keys written so far; the append then fails and
+//goes to a fresh block.
 void fBtree::future_Insert(int64_t key, int tid, bool isDone=false){
-    //printf("Future insert starts\n");
-  if(local_fut == NULL){
-    local_fut = new future_Node[n_threads];
-  } else{
-    if(local_fut[tid].next == NULL){
-      //Create a new node next to the dummy head node.
-      future_Node *first_node = new future_Node();
-      first_node->keys[0] = key;
-      first_node->entry_count += 1;
-      first_node->prev = &(local_fut[tid]);
-      local_fut[tid].next = first_node;
-      local_fut_tail[tid].next = first_node;
-      local_fut[tid].entry_count += 1;
-      hash[tid].Insert(key, tid);
-      clflush((char *)this, CACHELINE_SIZE);
-    } 
-    else if(local_fut[tid].next->entry_count == cardinality ){
-      //Create a new node and perform the evaluation on the previous node.
-      //Once evaluation is done, free the previous node and move the head node's next pointer to the current node who's next pointer is NULL
-      future_Node *new_node = new future_Node();
-
-      new_node->keys[0] = key;
-      new_node->entry_count += 1;
-      new_node->prev = &(local_fut[tid]);
-      new_node->next = local_fut[tid].next;
-      local_fut[tid].next->prev = new_node;
-      local_fut[tid].next = new_node;
-      local_fut[tid].entry_count += 1;
-
-      hash[tid].Insert(key, tid);
-
-      clflush((char *)this, CACHELINE_SIZE);
-    } 
-    else{
-      
-      //printf("Sorting the keys\n");
-      for(int i = local_fut[tid].next->entry_count-1; i >=0; i--){
-          if(key < local_fut[tid].next->keys[i]){
-            local_fut[tid].next->keys[i+1] = local_fut[tid].keys[i];
-
-            //flush 
-            uint64_t recd_ptr = (uint64_t)(&local_fut[tid].next->keys);
-            int remainder = recd_ptr % CACHELINE_SIZE;
-            bool do_flush = (remainder == 0) ||
-                        ((((int)(remainder + sizeof(future_Node)) / CACHELINE_SIZE) == 1) &&
-                        ((remainder + sizeof(future_Node)) % CACHELINE_SIZE) != 0);
-            if(do_flush){
-                clflush((char *)local_fut[tid].next->keys, CACHELINE_SIZE);
-            } 
-          } else{
-              local_fut[tid].next->keys[i+1] = key;
-              local_fut[tid].next->entry_count += 1;
-              hash[tid].Insert(key, tid);
-
-              clflush((char *)&local_fut[tid].next->keys[i+1], sizeof(entry));
-              break;
-            }
+  while(true){
+    future_Node *head = local_fut[tid].next;
+
+    if(head != NULL){
+      int n = __atomic_load_n(&head->entry_count, __ATOMIC_ACQUIRE);
+      if(n < cardinality){
+        head->keys[n] = key;
+        clflush((char *)&head->keys[n], sizeof(int64_t));
+        // Tagged with the block, so fut_Apply retires only this write.
+        hash[tid].Insert(key, key, (int64_t)head);
+
+        if(__atomic_compare_exchange_n(&head->entry_count, &n, n + 1, false,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+          // Append unsorted; a full block is sorted once, by its producer,
+          // before it is handed over for node-based insertion.
+          if(n + 1 == cardinality){
+            sortnet_sort(head->keys, cardinality);
+            clflush((char *)head->keys, sizeof(head->keys));
+            __atomic_or_fetch(&head->entry_count, FUT_SEALED, __ATOMIC_SEQ_CST);
+            fut_Wake();
+          }
+          return;
         }
+        // Sealed by an evaluator, retry in a fresh block.
+        continue;
+      }
     }
+
+    fut_Push(tid);
   }
+}
 
-  // printf("Entry Count: %ld, TId: %d\n", local_fut[tid].entry_count, tid);
-  /*if(local_fut[tid].entry_count > 1000){
-    //printf("Sleeping\n");
-    std::this_thread::sleep_for (std::chrono::microseconds(200));
-  }*/
- 
+//Link a fresh head block. An old head the evaluator has already applied is
+//still linked, as the producer may have been appending to it; free it here.
+void fBtree::fut_Push(int tid){
+  future_Node *node = new future_Node();
+  future_Node *retired = NULL;
+
+  fut_mtx[tid].lock();
+  future_Node *old = local_fut[tid].next;
+  node->prev = &(local_fut[tid]);
+  node->next = old;
+  if(old != NULL && old->is_done){
+    // Everything older is applied, so the old head is also the tail.
+    node->next = NULL;
+    retired = old;
+    old = NULL;
+  }
+  if(old != NULL)
+    old->prev = node;
+  else
+    local_fut_tail[tid].next = node;
+  local_fut[tid].next = node;
+  __atomic_add_fetch(&local_fut[tid].entry_count, 1, __ATOMIC_SEQ_CST);
+  fut_mtx[tid].unlock();
+
+  clflush((char *)&local_fut[tid].next, sizeof(future_Node *));
+  delete retired;
+  fut_Wake();
 }
 
 //Key-based insertion
@@ -768,104 +866,178 @@ void fBtree::fbtree_insert(int64_t key, char *right){
     
 }
 
-//node-based insertion
+//node-based insertion of a sorted block, one descent per target leaf
 void fBtree::fbtree_insert(int64_t rcd[], int num_entries){
-    //printf("Global NOde Insertion\n");
-    page *p = (page *)root;
-    //printf("Root Node: %x\n", root);
+    int i = 0;
+
+    while(i < num_entries){
+        page *p = (page *)root;
+        //Separators on the way down bound the leaf, its sibling's first
+        //key may have been deleted since the split.
+        int64_t bound = __LONG_MAX__;
+
+        while(p->gnode.leftmost_ptr != NULL){
+            page *next = (page *)p->linear_search(rcd[i]);
+            if(next != p->gnode.sibling_ptr){
+                for(int k = 0; p->records[k].ptr != NULL; k++){
+                    if(rcd[i] < p->records[k].keys){
+                        if(p->records[k].keys < bound)
+                            bound = p->records[k].keys;
+                        break;
+                    }
+                }
+            }
+            p = next;
+        }
 
-    while(p->gnode.leftmost_ptr != NULL)
-        p = (page *)p->linear_search(rcd[0]);
+        i += p->node_store(this, rcd + i, num_entries - i, bound, true);
+    }
+}
+
+//Wake the parked evaluators.
+void fBtree::fut_Wake(){
+    __atomic_add_fetch(&fut_signal, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&fut_parked, __ATOMIC_SEQ_CST) > 0)
+        futex_wake(&fut_signal, INT_MAX);
+}
 
-    if(!p->node_store(this, rcd, true))
-        fbtree_insert(rcd, num_entries);
+//No more keys will be buffered, idle evaluators return.
+void fBtree::fut_Shutdown(){
+    __atomic_store_n(&fut_shutdown, 1, __ATOMIC_SEQ_CST);
+    fut_Wake();
 }
 
 void fBtree::fut_Evaluate(fBtree *fb, int tid){
     //mutli-threaded Future Evaluate
-    int prod_to_cons;
-    do{
-        if(local_fut[tid].entry_count == 0){
-            //std::this_thread::sleep_for (std::chrono::microseconds(1000));
+    vector<int> seen(n_threads, 0);
+    int spins = 0;
+
+    while(true){
+        //Read before checking for work, so a block linked after this point
+        //makes the futex wait return at once.
+        int signal = __atomic_load_n(&fb->fut_signal, __ATOMIC_SEQ_CST);
+        bool shutdown = __atomic_load_n(&fb->fut_shutdown, __ATOMIC_SEQ_CST);
+        bool pending = false;
+
+        if(fb->future_evaluate_execute(fb, tid, seen.data(), &pending) > 0){
+            spins = 0;
             continue;
-        } else{
-            if(tid == 0){
-                prod_to_cons = ((n_threads/eval_threads)+(n_threads%eval_threads));
-                future_evaluate_execute(fb, tid, prod_to_cons);
-            }else{
-                prod_to_cons = (n_threads/eval_threads);
-                future_evaluate_execute(fb, tid, prod_to_cons);
-            }
         }
-        for(int i = tid; i < n_threads; i++){
-            if(local_fut[i].is_done){
-                fb->is_Done = true;
-            }
+        //Shut down and nothing applied in a whole pass: every producer of
+        //ours is drained.
+        if(shutdown && !pending)
+            break;
+
+        //Spin briefly, then sleep until a producer links or fills a block,
+        //or only for a while if a head has to be taken once it goes idle.
+        if(++spins < fut_spin){
+            cpu_pause();
+            continue;
         }
-    }while(!fb->is_Done);
+        spins = 0;
+        struct timespec idle;
+        idle.tv_sec = fut_idle_ns / 1000000000;
+        idle.tv_nsec = fut_idle_ns % 1000000000;
+        __atomic_add_fetch(&fb->fut_parked, 1, __ATOMIC_SEQ_CST);
+        futex_wait(&fb->fut_signal, signal, (pending || shutdown) ? &idle : NULL);
+        __atomic_sub_fetch(&fb->fut_parked, 1, __ATOMIC_SEQ_CST);
+    }
+
+    for(int i = tid; i < n_threads; i += eval_threads)
+        fb->local_fut[i].is_done = true;
+    __atomic_store_n(&fb->is_Done, true, __ATOMIC_RELEASE);
 }
 
+//Apply the blocks of producers tid .. tid+total_t-1, and their partially
+//filled heads once the tree is shut down.
 void fBtree::fut_Evaluate_execute(fBtree *fb, int tid, int total_t){
-    for(int i = tid; i < (tid + total_t); i++){
-        //for(int i = tid; i < n_threads; i++){    
-            future_Node *last = NULL;
-            while (last != fb->local_fut[i].next){
-                future_Node *current = fb->local_fut[i].next;
-                while(current->next != last)
-                    current = current->next;
-
-                //fb->fbtree_insert(current->keys);
-                //Key-based insertion
-                /*while (current->entry_count != 0)
-                {
-                    int i = current->entry_count;
-                    int64_t key = current->keys[i];
-                    fb->fbtree_insert(key, (char *)key);
-                    current->entry_count -= 1;
-                }*/
-
-                //Node-based insertion
-                if(current->entry_count == cardinality-1){
-                    fb->fbtree_insert(current->keys, current->entry_count);
-                } 
-                
-                last = current;
-                fb->local_fut[i].entry_count -= 1;
-                delete current;
-                if(fb->local_fut[i].entry_count == 0){
-                    fb->local_fut[i].is_done = true;
-                }           
-        }
+    vector<int> seen(n_threads, 0);
+    bool pending = false;
+
+    for(int i = tid; i < (tid + total_t) && i < n_threads; i++){
+        while(fb->fut_Apply(i, seen.data(), &pending) > 0)
+            ;
     }
 }
 
+//Producers are dealt round robin, so every one has exactly one evaluator.
+//Returns how many blocks were applied, and sets *pending if a head was left
+//open because its producer is still appending.
+int fBtree::future_evaluate_execute(fBtree *bt, int tid, int *seen,
+                                    bool *pending){
+  int applied = 0;
+
+  for(int i = tid; i < n_threads; i += eval_threads)
+    applied += bt->fut_Apply(i, seen, pending);
+  return applied;
+}
+
 //Using Tail Pointer.
-void fBtree::future_evaluate_execute(fBtree *bt, int tid, int total_t){
-  for(int i = (tid*total_t); i < ((tid+1) * total_t); i++){
-    future_Node *last_node = NULL;  
-    //printf("Last Node not NULL\n");
-    while(last_node != bt->local_fut[i].next){
-      future_Node *tail_node = bt->local_fut_tail[i].next;
-        /*for(int k = 0; k <= tail_node->entry_count; k++)
-          bt->fbtree_insert(tail_node->keys[k], (char *)tail_node->keys[k]);*/
-
-        if(tail_node->entry_count == cardinality){
-            bt->fbtree_insert(tail_node->keys, tail_node->entry_count);
-        } 
-
-
-        last_node = tail_node->prev;
-        bt->local_fut_tail[i].next = tail_node->prev;
-        bt->local_fut[i].entry_count -= 1;
-        delete tail_node;
-
-        if(bt->local_fut[i].entry_count == 0){
-          bt->local_fut[i].is_done = true;
-          break;
-        }
+//Apply producer i's blocks oldest first. A partially filled head is taken
+//too once its producer has not appended for a whole pass (seen[i] holds the
+//count of the last pass), or once the tree is shut down: it is sealed with a
+//CAS on entry_count and sorted here. The head stays linked after it is
+//applied and is freed by the producer's next fut_Push. Returns how many
+//blocks were applied, and sets *pending if a head was left open.
+int fBtree::fut_Apply(int i, int *seen, bool *pending){
+  bool shutdown = __atomic_load_n(&fut_shutdown, __ATOMIC_SEQ_CST);
+  int applied = 0;
+
+  while(true){
+    future_Node *node = NULL;
+    bool retire;
+
+    fut_mtx[i].lock();
+    future_Node *tail = local_fut_tail[i].next;
+    if(tail != NULL && !tail->is_done && !tail->is_claimed){
+      int n = __atomic_load_n(&tail->entry_count, __ATOMIC_ACQUIRE);
+      if(n & FUT_SEALED){
+        node = tail;
+      } else if(n > 0 && n < cardinality && (n == seen[i] || shutdown) &&
+                __atomic_compare_exchange_n(&tail->entry_count, &n,
+                                            n | FUT_SEALED, false,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)){
+        sortnet_sort(tail->keys, n);
+        clflush((char *)tail->keys, n * sizeof(int64_t));
+        node = tail;
+      } else if(n != 0){
+        //Still being appended to, or full and about to be sealed by its
+        //producer.
+        *pending = true;
+        seen[i] = n;
       }
+    }
+    if(node != NULL)
+      node->is_claimed = true;
+    fut_mtx[i].unlock();
+
+    if(node == NULL)
+      return applied;
+
+    int n = node->entry_count & ~FUT_SEALED;
+    fbtree_insert(node->keys, n);
+    applied++;
+    // The keys are in the tree now; a newer append of one of them carries
+    // another block's tag and stays.
+    for(int k = 0; k < n; k++)
+      hash[i].RemoveIf(node->keys[k], (int64_t)node);
+
+    fut_mtx[i].lock();
+    retire = (node != local_fut[i].next);
+    if(retire){
+      local_fut_tail[i].next = node->prev;
+      node->prev->next = NULL;
+    } else {
+      node->is_done = true;
+    }
+    __atomic_sub_fetch(&local_fut[i].entry_count, 1, __ATOMIC_SEQ_CST);
+    fut_mtx[i].unlock();
+
+    if(retire)
+      delete node;
+    seen[i] = 0;
   }
-  //printf("Evaluate Execute Returns\n");
 }
 
 void fBtree::printLocalFutures(fBtree *bt, int tid){
@@ -874,7 +1046,7 @@ void fBtree::printLocalFutures(fBtree *bt, int tid){
 
     while (tmp != NULL)
     {
-        for(int i = 0; i < tmp->entry_count; i++){
+        for(int i = 0; i < (tmp->entry_count & ~FUT_SEALED); i++){
             printf("Key: %lld \n", tmp->keys[i]);
         }
         tmp = tmp->next;
@@ -915,7 +1087,7 @@ void fBtree::fbtree_search_range(int64_t min, int64_t max,
   }
 }
 
-/*void fBtree::fbtree_delete(int64_t key) {
+void fBtree::fbtree_delete(int64_t key) {
   page *p = (page *)root;
 
   while (p->gnode.leftmost_ptr != NULL) {
@@ -929,12 +1101,10 @@ void fBtree::fbtree_search_range(int64_t min, int64_t max,
       break;
   }
 
-  if (p) {
-    if (!p->remove(this, key)) {
-      btree_delete(key);
+  // A missing key has nothing to delete
+  if (p && t) {
+    if (!p->remove(key)) {
+      fbtree_delete(key);
     }
-  } else {
-    printf("not found the key to delete %lu\n", key);
   }
-}
-*/
\ No newline at end of file
+}
\ No newline at end of file
@@ -34,8 +34,7 @@ int main(int argc, char **argv){
     }
 
     int64_t *keys = new int64_t[num_data];
-    T_S = num_data;
-    HashMapTable *hash;
+    HashMapTable *hash = new HashMapTable(num_data);
     
     ifstream ifs;
     ifs.open(input_path);
@@ -64,7 +63,11 @@ int main(int argc, char **argv){
                     },
                     from, to);*/
         for(int i = from; i < to; ++i){
-            auto f = std::async(std::launch::deferred, &HashMapTable::Insert, (*hash), keys[i], tid);
+            auto f = std::async(std::launch::deferred,
+                                [hash](int64_t key, int value) {
+                                    hash->Insert(key, value);
+                                },
+                                keys[i], tid);
             futures.push_back(move(f));
         }
         
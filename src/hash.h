@@ -2,110 +2,385 @@
 #include <cstdio>
 #include <cstdlib>
 #include <mutex>
+#include <stdint.h>
+#include <string.h>
+#include <new>
+#include <sched.h>
+#include <vector>
 using namespace std;
-int T_S;
+
+// murmur3 finalizer, spreads every key bit over the whole word
+static inline uint64_t hash_mix(uint64_t k) {
+   k ^= k >> 33;
+   k *= 0xff51afd7ed558ccdULL;
+   k ^= k >> 33;
+   k *= 0xc4ceb9fe1a85ec53ULL;
+   k ^= k >> 33;
+   return k;
+}
+
 class HashTable {
    public:
       int64_t k;
-      int v;
-      HashTable(int64_t k, int v) {
-         this->k = k;
-         this->v = v;
-      }
-};
-class DelNode:public HashTable {
-   private:
-      static DelNode *en;
-      DelNode():HashTable(-1, -1) {}
-   public:
-      static DelNode *getNode() {
-         if (en == NULL)
-            en = new DelNode();
-         return en;
-      }
+      int64_t v;
+      int64_t t; // identifies the write that stored v
 };
 
-DelNode *DelNode::en = NULL;
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
+// Open addressing map from 64-bit keys to 64-bit values. Slots are stored
+// inline in a power-of-two array, so an insert never allocates unless the
+// table has to grow. Every slot has a one-byte control tag: EMPTY, DELETED
+// or the low 7 bits of the key's hash. Slots are probed 16 at a time, one
+// group per step, by comparing the whole group of tags against the key's
+// tag (a single SSE2 compare), so a miss usually ends after one group. The
+// capacity follows the number of live keys: the table doubles past 3/4
+// load, is rebuilt in place when tombstones fill it, and halves when it
+// drops below 1/8 load.
+//
+// Writers are serialized by a per-table mutex. Readers take no lock: every
+// group carries a sequence number that writers make odd while they change
+// the group, and a reader retries a group it saw change under it. A resize
+// builds a new array and publishes it with one pointer store; the old one
+// is freed once no reader that could have loaded it is left, which readers
+// announce on one of two counters picked by the current epoch.
 class HashMapTable {
    private:
-      HashTable **ht;
-      //std::mutex *hash_mtx;
-   public:
-      HashMapTable() {
-         ht = new HashTable* [T_S];
-         //hash_mtx = new std::mutex();
-         for (int i = 0; i < T_S; i++) {
-            ht[i] = NULL;
+      enum { GROUP = 16 };
+      static const int8_t EMPTY = (int8_t)0x80;
+      static const int8_t DELETED = (int8_t)0xFE;
+      static const size_t MIN_CAPACITY = GROUP;
+
+      struct Array {
+         size_t capacity;
+         size_t gmask;
+         HashTable *ht;
+         int8_t *ctrl;
+         unsigned *seq; // per group, odd while a writer is in it
+      };
+
+      Array *arr;
+      size_t live;
+      size_t tombstones;
+      std::mutex hash_mtx; // writers only
+      unsigned epoch;
+      int readers[2];
+
+      HashMapTable(const HashMapTable &);
+      HashMapTable &operator=(const HashMapTable &);
+
+      // Bit i is set when tag i of the group equals t
+      static uint32_t Match(const int8_t *grp, int8_t t) {
+#ifdef __SSE2__
+         __m128i g = _mm_load_si128((const __m128i *)grp);
+         return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(t)));
+#else
+         uint32_t m = 0;
+         for (int i = 0; i < GROUP; i++)
+            m |= (uint32_t)(__atomic_load_n(&grp[i], __ATOMIC_RELAXED) == t) << i;
+         return m;
+#endif
+      }
+
+      // Group index from the high bits, 7-bit tag from the low bits
+      static size_t H1(const Array *a, uint64_t h) { return (h >> 7) & a->gmask; }
+      static int8_t H2(uint64_t h) { return (int8_t)(h & 0x7f); }
+
+      static Array *NewArray(size_t cap) {
+         void *mem;
+         Array *a = new Array;
+         a->capacity = cap;
+         a->gmask = cap / GROUP - 1;
+         a->ht = new HashTable[cap];
+         if (posix_memalign(&mem, GROUP, cap) != 0)
+            throw std::bad_alloc();
+         a->ctrl = (int8_t *)mem;
+         memset(a->ctrl, EMPTY, cap);
+         a->seq = new unsigned[cap / GROUP]();
+         return a;
+      }
+
+      static void FreeArray(Array *a) {
+         delete[] a->ht;
+         free(a->ctrl);
+         delete[] a->seq;
+         delete a;
+      }
+
+      // Announce a reader and return the counter it must drop in Exit
+      int Enter() {
+         while (true) {
+            unsigned e = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+            __atomic_add_fetch(&readers[e & 1], 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&epoch, __ATOMIC_SEQ_CST) == e)
+               return e & 1;
+            __atomic_sub_fetch(&readers[e & 1], 1, __ATOMIC_SEQ_CST);
          }
       }
-      int HashFunc(int k) {
-         return k % T_S;
-      }
-
-      void Insert(int64_t k, int v) {
-         //hash_mtx->lock();
-         int hash_val = HashFunc(k);
-         int init = -1;
-         int delindex = -1;
-         while (hash_val != init && (ht[hash_val]  == DelNode::getNode() || ht[hash_val] != NULL && ht[hash_val]->k != k)) {
-            if (init == -1)
-               init = hash_val;
-            if (ht[hash_val] == DelNode::getNode())
-               delindex = hash_val;
-               hash_val = HashFunc(hash_val + 1);
+
+      void Exit(int r) {
+         __atomic_sub_fetch(&readers[r], 1, __ATOMIC_RELEASE);
+      }
+
+      // Swap in a new array and free the old one once its readers are gone.
+      // Readers that enter after the epoch moves only see the new array.
+      void Publish(Array *a) {
+         Array *old = arr;
+         __atomic_store_n(&arr, a, __ATOMIC_SEQ_CST);
+         unsigned e = __atomic_fetch_add(&epoch, 1, __ATOMIC_SEQ_CST);
+         while (__atomic_load_n(&readers[e & 1], __ATOMIC_ACQUIRE) != 0)
+            sched_yield();
+         FreeArray(old);
+      }
+
+      // Writers bracket every change to a group with these two
+      static void BeginWrite(Array *a, size_t g) {
+         __atomic_store_n(&a->seq[g], a->seq[g] + 1, __ATOMIC_RELAXED);
+         __atomic_thread_fence(__ATOMIC_RELEASE);
+      }
+
+      static void EndWrite(Array *a, size_t g) {
+         __atomic_store_n(&a->seq[g], a->seq[g] + 1, __ATOMIC_RELEASE);
+      }
+
+      // Slot holding k, or -1. Writers only.
+      int64_t Find(int64_t k) {
+         uint64_t h = hash_mix((uint64_t)k);
+         int8_t tag = H2(h);
+         for (size_t g = H1(arr, h), step = 1;; g = (g + step++) & arr->gmask) {
+            const int8_t *grp = arr->ctrl + g * GROUP;
+            for (uint32_t m = Match(grp, tag); m; m &= m - 1) {
+               size_t i = g * GROUP + __builtin_ctz(m);
+               if (arr->ht[i].k == k)
+                  return i;
+            }
+            if (Match(grp, EMPTY))
+               return -1;
          }
-         if (ht[hash_val] == NULL || hash_val == init) {
-            if(delindex != -1)
-               ht[delindex] = new HashTable(k, v);
-            else
-               ht[hash_val] = new HashTable(k, v);
+      }
+
+      void Rehash(size_t cap) {
+         Array *a = NewArray(cap);
+
+         for (size_t i = 0; i < arr->capacity; i++) {
+            if (arr->ctrl[i] >= 0)
+               Place(a, arr->ht[i].k, arr->ht[i].v, arr->ht[i].t);
          }
-         if(init != hash_val) {
-            if (ht[hash_val] != DelNode::getNode()) {
-               if (ht[hash_val] != NULL) {
-                  if (ht[hash_val]->k== k)
-                     ht[hash_val]->v = v;
+         tombstones = 0;
+         Publish(a);
+      }
+
+      // Put a key that is known to be absent into an unpublished array
+      static void Place(Array *a, int64_t k, int64_t v, int64_t t) {
+         uint64_t h = hash_mix((uint64_t)k);
+         size_t g, step;
+         uint32_t empty;
+         for (g = H1(a, h), step = 1; !(empty = Match(a->ctrl + g * GROUP, EMPTY));
+              g = (g + step++) & a->gmask)
+            ;
+         size_t i = g * GROUP + __builtin_ctz(empty);
+         a->ht[i].k = k;
+         a->ht[i].v = v;
+         a->ht[i].t = t;
+         a->ctrl[i] = H2(h);
+      }
+
+      void Erase(size_t i) {
+         size_t g = i / GROUP;
+         BeginWrite(arr, g);
+         __atomic_store_n(&arr->ctrl[i], DELETED, __ATOMIC_RELAXED);
+         EndWrite(arr, g);
+         live--;
+         tombstones++;
+
+         if (arr->capacity > MIN_CAPACITY && live * 8 < arr->capacity)
+            Rehash(arr->capacity / 2);
+      }
+
+      void Put(int64_t k, int64_t v, int64_t t) {
+         // Past 3/4 load grow, unless the load is mostly tombstones, in
+         // which case a rebuild at the same size is enough. Either way an
+         // EMPTY tag is always left for probes to stop at.
+         size_t cap = arr->capacity;
+         if ((live + tombstones + 1) * 4 > cap * 3)
+            Rehash((live + 1) * 2 > cap ? cap * 2 : cap);
+
+         uint64_t h = hash_mix((uint64_t)k);
+         int8_t tag = H2(h);
+         int64_t reuse = -1;
+         size_t g, step;
+         uint32_t empty;
+         for (g = H1(arr, h), step = 1;; g = (g + step++) & arr->gmask) {
+            const int8_t *grp = arr->ctrl + g * GROUP;
+            for (uint32_t m = Match(grp, tag); m; m &= m - 1) {
+               size_t i = g * GROUP + __builtin_ctz(m);
+               if (arr->ht[i].k == k) {
+                  BeginWrite(arr, g);
+                  __atomic_store_n(&arr->ht[i].v, v, __ATOMIC_RELAXED);
+                  __atomic_store_n(&arr->ht[i].t, t, __ATOMIC_RELAXED);
+                  EndWrite(arr, g);
+                  return;
                }
-            } else
-            ht[hash_val] = new HashTable(k, v);
+            }
+            if (reuse == -1) {
+               uint32_t del = Match(grp, DELETED);
+               if (del)
+                  reuse = g * GROUP + __builtin_ctz(del);
+            }
+            if ((empty = Match(grp, EMPTY)))
+               break;
          }
-         //hash_mtx->unlock();
-      }
 
-      int SearchKey(int64_t k) {
-         int hash_val = HashFunc(k);
-         int init = -1;
-         while (hash_val != init && (ht[hash_val] == DelNode::getNode() || ht[hash_val] != NULL && ht[hash_val]->k!= k)) {
-            if (init == -1)
-               init = hash_val;
-               hash_val = HashFunc(hash_val + 1);
+         size_t i;
+         if (reuse != -1) {
+            i = reuse;
+            tombstones--;
+         } else {
+            i = g * GROUP + __builtin_ctz(empty);
          }
-         if (ht[hash_val] == NULL || hash_val == init)
-            return -1;
-         else
-            return ht[hash_val]->v;
+         g = i / GROUP;
+         BeginWrite(arr, g);
+         __atomic_store_n(&arr->ht[i].k, k, __ATOMIC_RELAXED);
+         __atomic_store_n(&arr->ht[i].v, v, __ATOMIC_RELAXED);
+         __atomic_store_n(&arr->ht[i].t, t, __ATOMIC_RELAXED);
+         __atomic_store_n(&arr->ctrl[i], tag, __ATOMIC_RELAXED);
+         EndWrite(arr, g);
+         live++;
       }
 
-      void Remove(int64_t k) {
-         //hash_mtx->lock();
-         int hash_val = HashFunc(k);
-         int init = -1;
-         while (hash_val != init && (ht[hash_val] == DelNode::getNode() || ht[hash_val] != NULL && ht[hash_val]->k!= k)) {
-            if (init == -1)
-               init = hash_val;
-               hash_val = HashFunc(hash_val + 1);
+   public:
+      HashMapTable(size_t initial_capacity = MIN_CAPACITY) {
+         size_t cap = MIN_CAPACITY;
+         while (cap < initial_capacity)
+            cap <<= 1;
+         arr = NewArray(cap);
+         live = 0;
+         tombstones = 0;
+         epoch = 0;
+         readers[0] = readers[1] = 0;
+      }
+
+      void Insert(int64_t k, int64_t v) {
+         Insert(k, v, v);
+      }
+
+      // Store v for k, tagged with t so a later RemoveIf can tell whether
+      // k still holds this write.
+      void Insert(int64_t k, int64_t v, int64_t t) {
+         hash_mtx.lock();
+         Put(k, v, t);
+         hash_mtx.unlock();
+      }
+
+      // Returns the value stored for k, or -1 if k is absent. Safe to call
+      // from any thread while writers are active.
+      int64_t SearchKey(int64_t k) {
+         int64_t v, t;
+         return Lookup(k, &v, &t) ? v : -1;
+      }
+
+      // Fetch the value and tag stored for k. Returns false if k is absent.
+      bool Lookup(int64_t k, int64_t *v, int64_t *t) {
+         uint64_t h = hash_mix((uint64_t)k);
+         int8_t tag = H2(h);
+         bool ret = false;
+         int r = Enter();
+         Array *a = __atomic_load_n(&arr, __ATOMIC_ACQUIRE);
+
+         for (size_t g = H1(a, h), step = 1;; g = (g + step++) & a->gmask) {
+            const int8_t *grp = a->ctrl + g * GROUP;
+            bool found, empty;
+            unsigned s;
+            do {
+               while ((s = __atomic_load_n(&a->seq[g], __ATOMIC_ACQUIRE)) & 1)
+                  sched_yield();
+               found = false;
+               for (uint32_t m = Match(grp, tag); m; m &= m - 1) {
+                  size_t i = g * GROUP + __builtin_ctz(m);
+                  if (__atomic_load_n(&a->ht[i].k, __ATOMIC_RELAXED) == k) {
+                     *v = __atomic_load_n(&a->ht[i].v, __ATOMIC_RELAXED);
+                     *t = __atomic_load_n(&a->ht[i].t, __ATOMIC_RELAXED);
+                     found = true;
+                     break;
+                  }
+               }
+               empty = (Match(grp, EMPTY) != 0);
+               __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            } while (__atomic_load_n(&a->seq[g], __ATOMIC_RELAXED) != s);
+
+            if (found || empty) {
+               ret = found;
+               break;
+            }
          }
-        
-         if (hash_val != init && ht[hash_val] != NULL) {
-            delete ht[hash_val];
-            ht[hash_val] = DelNode::getNode();
+
+         Exit(r);
+         return ret;
+      }
+
+      // Append every key in [min, max) and its value to keys and vals, in
+      // no particular order. Safe to call while writers are active: each
+      // group is copied whole and copied again if a writer changed it
+      // meanwhile. Visits the whole array, so it costs the capacity.
+      void Scan(int64_t min, int64_t max, vector<int64_t> *keys,
+                vector<int64_t> *vals) {
+         int64_t k[GROUP], v[GROUP];
+         int r = Enter();
+         Array *a = __atomic_load_n(&arr, __ATOMIC_ACQUIRE);
+
+         for (size_t g = 0; g <= a->gmask; g++) {
+            int n;
+            unsigned s;
+            do {
+               while ((s = __atomic_load_n(&a->seq[g], __ATOMIC_ACQUIRE)) & 1)
+                  sched_yield();
+               n = 0;
+               for (size_t i = g * GROUP; i < (g + 1) * GROUP; i++) {
+                  if (__atomic_load_n(&a->ctrl[i], __ATOMIC_RELAXED) < 0)
+                     continue;
+                  int64_t key = __atomic_load_n(&a->ht[i].k, __ATOMIC_RELAXED);
+                  if (key < min || key >= max)
+                     continue;
+                  k[n] = key;
+                  v[n++] = __atomic_load_n(&a->ht[i].v, __ATOMIC_RELAXED);
+               }
+               __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            } while (__atomic_load_n(&a->seq[g], __ATOMIC_RELAXED) != s);
+
+            keys->insert(keys->end(), k, k + n);
+            vals->insert(vals->end(), v, v + n);
          }
-         //hash_mtx->unlock();
+
+         Exit(r);
+      }
+
+      void Remove(int64_t k) {
+         hash_mtx.lock();
+         int64_t i = Find(k);
+         if (i != -1)
+            Erase(i);
+         hash_mtx.unlock();
+      }
+
+      // Remove k only while it still holds the write tagged t, so a stale
+      // remove cannot drop a newer value. Returns true if k was removed.
+      bool RemoveIf(int64_t k, int64_t t) {
+         hash_mtx.lock();
+         int64_t i = Find(k);
+         bool removed = (i != -1 && arr->ht[i].t == t);
+         if (removed)
+            Erase(i);
+         hash_mtx.unlock();
+         return removed;
+      }
+
+      size_t Size() {
+         return __atomic_load_n(&live, __ATOMIC_RELAXED);
       }
 
       ~HashMapTable() {
-         delete[] ht;
-         //delete hash_mtx;
+         FreeArray(arr);
       }
 };
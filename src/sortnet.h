@@ -0,0 +1,119 @@
+#ifndef SORTNET_H_
+#define SORTNET_H_
+
+#include <stdint.h>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+// The AVX2 network is compiled in regardless of -mavx2 and picked at run
+// time, so the default build uses it on any CPU that has it.
+#define SORTNET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// Sorting network for future blocks. A block holds about 30 keys, so it is
+// padded with INT64_MAX to 32 and run through a fixed bitonic network: no
+// data dependent branches, and with AVX2 every compare-exchange stage is a
+// handful of 4-lane min/max operations on eight registers.
+#define SORTNET_WIDTH 32
+
+#ifdef SORTNET_AVX2
+SORTNET_AVX2 static inline void sortnet_minmax(__m256i a, __m256i b, __m256i *mn, __m256i *mx) {
+  __m256i gt = _mm256_cmpgt_epi64(a, b);
+  *mn = _mm256_blendv_epi8(a, b, gt);
+  *mx = _mm256_blendv_epi8(b, a, gt);
+}
+
+SORTNET_AVX2 static void sortnet_32_avx2(int64_t *a) {
+  __m256i v[SORTNET_WIDTH / 4];
+
+  for (int p = 0; p < SORTNET_WIDTH / 4; p++)
+    v[p] = _mm256_loadu_si256((const __m256i *)(a + 4 * p));
+
+  for (int k = 2; k <= SORTNET_WIDTH; k <<= 1) {
+    for (int j = k >> 1; j > 0; j >>= 1) {
+      if (j >= 4) {
+        // Partners sit in different registers, and the direction is the
+        // same for all four lanes of a register.
+        int d = j >> 2;
+        for (int p = 0; p < SORTNET_WIDTH / 4; p++) {
+          if (p & d)
+            continue;
+          __m256i mn, mx;
+          sortnet_minmax(v[p], v[p | d], &mn, &mx);
+          bool up = ((4 * p) & k) == 0;
+          v[p] = up ? mn : mx;
+          v[p | d] = up ? mx : mn;
+        }
+      } else {
+        // Partners are lanes of the same register. A lane keeps the
+        // minimum when it is the lower of its pair in an ascending run, or
+        // the upper one in a descending run.
+        for (int p = 0; p < SORTNET_WIDTH / 4; p++) {
+          __m256i other = (j == 2) ? _mm256_permute4x64_epi64(v[p], 0x4E)
+                                   : _mm256_permute4x64_epi64(v[p], 0xB1);
+          int64_t keep[4];
+          for (int l = 0; l < 4; l++) {
+            int i = 4 * p + l;
+            keep[l] = (((i & j) == 0) == ((i & k) == 0)) ? -1 : 0;
+          }
+          __m256i mask = _mm256_loadu_si256((const __m256i *)keep);
+          __m256i mn, mx;
+          sortnet_minmax(v[p], other, &mn, &mx);
+          v[p] = _mm256_blendv_epi8(mx, mn, mask);
+        }
+      }
+    }
+  }
+
+  for (int p = 0; p < SORTNET_WIDTH / 4; p++)
+    _mm256_storeu_si256((__m256i *)(a + 4 * p), v[p]);
+}
+#endif
+
+static inline void sortnet_32_scalar(int64_t *a) {
+  for (int k = 2; k <= SORTNET_WIDTH; k <<= 1) {
+    for (int j = k >> 1; j > 0; j >>= 1) {
+      for (int i = 0; i < SORTNET_WIDTH; i++) {
+        int l = i ^ j;
+        if (l <= i)
+          continue;
+        int64_t x = a[i], y = a[l];
+        int64_t mn = (x < y) ? x : y;
+        int64_t mx = (x < y) ? y : x;
+        bool up = (i & k) == 0;
+        a[i] = up ? mn : mx;
+        a[l] = up ? mx : mn;
+      }
+    }
+  }
+}
+
+static inline void sortnet_32(int64_t *a) {
+#ifdef SORTNET_AVX2
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  if (avx2) {
+    sortnet_32_avx2(a);
+    return;
+  }
+#endif
+  sortnet_32_scalar(a);
+}
+
+// Sort the first n keys in place.
+static inline void sortnet_sort(int64_t *keys, int n) {
+  if (n <= 1)
+    return;
+  if (n > SORTNET_WIDTH) {
+    std::sort(keys, keys + n);
+    return;
+  }
+
+  int64_t buf[SORTNET_WIDTH];
+  for (int i = 0; i < SORTNET_WIDTH; i++)
+    buf[i] = (i < n) ? keys[i] : INT64_MAX;
+  sortnet_32(buf);
+  for (int i = 0; i < n; i++)
+    keys[i] = buf[i];
+}
+
+#endif // SORTNET_H_
@@ -0,0 +1,387 @@
+#include "btree.h"
+#include <map>
+#include <sys/wait.h>
+
+// Checks the buffered operations and the scans against a std::map.
+//
+// One thread plays every producer, and no evaluator runs: operations stay
+// in the buffers until future_sync_all applies them from this thread. So
+// the tree only changes when the check says so, and every answer has to
+// match the map exactly. Producer tid owns the keys equal to tid modulo the
+// number of producers, so the newest operation on a key is always the one
+// btree_search and the merged scan report.
+//
+// With -c, real producer threads run against running evaluators instead,
+// once per buffer configuration in check_configs. Readers may miss a key
+// while a leaf is being rewritten, so nothing is compared until the
+// producers are done and future_sync_all has applied everything.
+
+typedef std::map<entry_key_t, char *> model_t;
+
+static long failures = 0;
+
+// Upserted values sit above every key, so they never equal the value an
+// insert stores for a neighbouring key; see future_upsert.
+static char *upsert_value(entry_key_t key, unsigned r) {
+  return (char *)((1L << 40) + key * 8 + 1 + r % 7);
+}
+
+static void expect(bool ok, const char *what, entry_key_t a, entry_key_t b) {
+  if (ok)
+    return;
+  if (failures < 10)
+    cout << "FAIL " << what << " " << a << " " << b << endl;
+  ++failures;
+}
+
+// Pairs of model in [min, max)
+static void model_range(model_t &model, entry_key_t min, entry_key_t max,
+                        vector<entry_key_t> *keys, vector<char *> *ptrs) {
+  for (model_t::iterator it = model.lower_bound(min);
+       it != model.end() && it->first < max; ++it) {
+    keys->push_back(it->first);
+    ptrs->push_back(it->second);
+  }
+}
+
+static void check_merged(btree *bt, model_t &model, entry_key_t min,
+                         entry_key_t max, bool drain) {
+  vector<entry_key_t> keys, want_keys;
+  vector<char *> ptrs, want_ptrs;
+
+  long n = bt->btree_search_range_merged(min, max, &keys, &ptrs, drain);
+  model_range(model, min, max, &want_keys, &want_ptrs);
+  expect(n == (long)want_keys.size() && keys == want_keys && ptrs == want_ptrs,
+         drain ? "merged drain" : "merged", min, max);
+}
+
+static void check_points(btree *bt, model_t &model, entry_key_t key_space) {
+  for (entry_key_t k = 1; k <= key_space; ++k) {
+    model_t::iterator it = model.find(k);
+    char *want = (it == model.end()) ? NULL : it->second;
+    expect(bt->btree_search(k) == want, "search", k, (entry_key_t)want);
+  }
+}
+
+// Only valid once everything is applied, the tree scans do not look at the
+// buffers.
+static void check_tree(btree *bt, model_t &model, entry_key_t min,
+                       entry_key_t max) {
+  vector<entry_key_t> want_keys, keys;
+  vector<char *> want_ptrs, ptrs;
+  entry_key_t key;
+  char *ptr;
+
+  model_range(model, min, max, &want_keys, &want_ptrs);
+
+  btree_Cursor cursor(bt, max);
+  cursor.seek(min);
+  while (cursor.next(&key, &ptr)) {
+    keys.push_back(key);
+    ptrs.push_back(ptr);
+  }
+  expect(keys == want_keys && ptrs == want_ptrs, "cursor", min, max);
+
+  keys.clear();
+  ptrs.clear();
+  btree_ReverseCursor reverse(bt, min);
+  reverse.seek(max - 1);
+  while (reverse.next(&key, &ptr)) {
+    keys.insert(keys.begin(), key);
+    ptrs.insert(ptrs.begin(), ptr);
+  }
+  expect(keys == want_keys && ptrs == want_ptrs, "reverse cursor", min, max);
+
+  keys.clear();
+  ptrs.clear();
+  bt->btree_search_range_parallel(min, max, 3, &keys, &ptrs);
+  expect(keys == want_keys && ptrs == want_ptrs, "parallel", min, max);
+
+  // Exclusive bounds, so min itself is left out.
+  vector<unsigned long> buf(want_keys.size() + 1);
+  int n = bt->btree_search_range(min, max, buf.data(), (int)buf.size());
+  size_t skip = (!want_keys.empty() && want_keys[0] == min) ? 1 : 0;
+  bool same = (n == (int)(want_keys.size() - skip));
+  for (int i = 0; same && i < n; ++i)
+    same = (buf[i] == (unsigned long)want_ptrs[i + skip]);
+  expect(same, "bounded range", min, max);
+}
+
+// A short range must stop at the first key past it. Every leaf it copies
+// but the last one has a separator inside the range, so there are at most
+// width + 1 of them, plus an emptied leaf or two.
+static void check_short(btree *bt, model_t &model, entry_key_t min,
+                        entry_key_t width) {
+  vector<entry_key_t> keys, want_keys;
+  vector<char *> want_ptrs;
+  entry_key_t key;
+  char *ptr;
+
+  model_range(model, min, min + width, &want_keys, &want_ptrs);
+  btree_Cursor cursor(bt, min + width);
+  cursor.seek(min);
+  while (cursor.next(&key, &ptr))
+    keys.push_back(key);
+  expect(keys == want_keys, "short range", min, width);
+  expect(cursor.leaves() <= width + 3, "short range leaves", min,
+         cursor.leaves());
+}
+
+// One value for neighbouring keys is not supported, see future_upsert.
+// Applying it has to stop on the assert rather than lose a key, so the
+// child that tries must die.
+static void check_shared_value() {
+#ifndef NDEBUG
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (!freopen("/dev/null", "w", stderr))
+      _exit(0);
+    btree *bt = new btree();
+    for (entry_key_t k = 10; k < 13; ++k)
+      bt->future_upsert(k, (char *)0x1000, 0);
+    bt->future_sync_all();
+    _exit(0);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  expect(WIFSIGNALED(status), "shared value applied", 10, 12);
+#endif
+}
+
+// -1 is a value like any other: a buffered -1 has to read back, not pass
+// for a missing key and let the tree answer.
+static void check_minus_one() {
+  btree *bt = new btree();
+  bt->future_insert(-1, 0);
+  expect(bt->btree_search(-1) == (char *)-1, "buffered -1", -1,
+         (entry_key_t)bt->btree_search(-1));
+
+  // Key 3 keeps the two -1 values from being neighbours in the leaf.
+  bt->future_upsert(3, (char *)0x30, 0);
+  bt->future_upsert(5, (char *)0x50, 0);
+  bt->future_sync_all();
+  bt->future_upsert(5, (char *)-1, 0);
+  expect(bt->btree_search(5) == (char *)-1, "buffered -1 over tree", 5,
+         (entry_key_t)bt->btree_search(5));
+
+  bt->future_sync_all();
+  expect(bt->btree_search(-1) == (char *)-1, "applied -1", -1,
+         (entry_key_t)bt->btree_search(-1));
+  expect(bt->btree_search(5) == (char *)-1, "applied -1 over tree", 5,
+         (entry_key_t)bt->btree_search(5));
+  bt->future_shutdown();
+  delete bt;
+}
+
+struct check_config {
+  const char *name;
+  int evals, evals_min;
+  int thread_cap, global_cap, overflow, help_depth;
+  bool partitioned, bypass;
+};
+
+static const check_config check_configs[] = {
+    {"shared", 2, 0, 0, 0, FUT_BLOCK, 0, false, false},
+    {"help caps", 2, 0, 2, 6, FUT_HELP, 0, false, false},
+    {"help depth", 2, 0, 0, 0, FUT_BLOCK, 2, false, false},
+    {"partitioned", 3, 0, 2, 0, FUT_BLOCK, 0, true, false},
+    {"bypass", 2, 0, 0, 0, FUT_BLOCK, 0, false, true},
+    {"adaptive", 4, 1, 0, 0, FUT_BLOCK, 0, false, false},
+};
+
+// Producer tid's share of a round, recorded in its own model.
+static void produce(btree *bt, model_t *model, int tid, int ops,
+                    entry_key_t key_space, unsigned seed) {
+  for (int i = 0; i < ops; ++i) {
+    entry_key_t key = 1 + rand_r(&seed) % key_space;
+    key += tid - key % n_threads;
+    if (key < 1)
+      key += n_threads;
+
+    switch (rand_r(&seed) % 8) {
+    case 0:
+    case 1:
+      bt->future_insert(key, tid);
+      (*model)[key] = (char *)key;
+      break;
+    case 2:
+    case 3:
+    case 4: {
+      char *ptr = upsert_value(key, rand_r(&seed));
+      bt->future_upsert(key, ptr, tid);
+      (*model)[key] = ptr;
+      break;
+    }
+    case 5:
+      bt->future_delete(key, tid);
+      model->erase(key);
+      break;
+    default:
+      // Only to have readers in the leaves the evaluators write, see the
+      // top of the file.
+      bt->btree_search(key);
+      break;
+    }
+  }
+}
+
+static void check_concurrent(const check_config &cfg, int rounds, int ops,
+                             int n_thrds, entry_key_t key_space,
+                             unsigned seed) {
+  long before = failures;
+
+  n_threads = n_thrds;
+  eval_threads = cfg.evals;
+  eval_threads_min = cfg.evals_min;
+  fut_thread_cap = cfg.thread_cap;
+  fut_global_cap = cfg.global_cap;
+  fut_overflow = cfg.overflow;
+  fut_help_depth = cfg.help_depth;
+  fut_partitioned = cfg.partitioned;
+  fut_bypass = cfg.bypass;
+
+  btree *bt = new btree();
+  vector<model_t> models(n_threads);
+  vector<future<void>> evaluators;
+  for (int e = 0; e < eval_threads; ++e)
+    evaluators.push_back(
+        async(launch::async, &btree::future_evaluate, bt, bt, e));
+
+  for (int r = 0; r < rounds; ++r) {
+    vector<future<void>> producers;
+    for (int tid = 0; tid < n_threads; ++tid)
+      producers.push_back(async(launch::async, produce, bt, &models[tid], tid,
+                                ops / n_threads, key_space,
+                                seed + r * n_threads + tid));
+    for (auto &&f : producers)
+      f.get();
+
+    bt->future_sync_all();
+    model_t model;
+    for (int tid = 0; tid < n_threads; ++tid)
+      model.insert(models[tid].begin(), models[tid].end());
+
+    check_points(bt, model, key_space);
+    check_merged(bt, model, LONG_MIN, LONG_MAX, false);
+    check_tree(bt, model, LONG_MIN, LONG_MAX);
+    for (int i = 0; i < 4; ++i) {
+      entry_key_t min = 1 + rand() % key_space;
+      check_tree(bt, model, min, min + rand() % (key_space / 8) + 1);
+    }
+  }
+
+  bt->future_shutdown();
+  for (auto &&f : evaluators)
+    f.get();
+  delete bt;
+
+  cout << "check " << cfg.name << ": " << failures - before << " failures"
+       << endl;
+}
+
+// MAIN
+int main(int argc, char **argv) {
+  int rounds = 20;
+  int ops = 20000;
+  int n_thrds = 4;
+  entry_key_t key_space = 50000;
+  unsigned seed = 1;
+  bool concurrent = false;
+
+  int c;
+  while ((c = getopt(argc, argv, "r:n:t:k:s:c")) != -1) {
+    switch (c) {
+    case 'r':
+      rounds = atoi(optarg);
+      break;
+    case 'n':
+      ops = atoi(optarg);
+      break;
+    case 't':
+      n_thrds = atoi(optarg);
+      break;
+    case 'k':
+      key_space = atol(optarg);
+      break;
+    case 's':
+      seed = atoi(optarg);
+      break;
+    case 'c':
+      concurrent = true;
+      break;
+    default:
+      break;
+    }
+  }
+
+  srand(seed);
+  if (concurrent) {
+    for (const check_config &cfg : check_configs)
+      check_concurrent(cfg, std::max(1, rounds / 4), ops, n_thrds, key_space,
+                       seed);
+    return failures == 0 ? 0 : 1;
+  }
+
+  n_threads = n_thrds;
+  eval_threads = 1;
+  btree *bt = new btree();
+  model_t model;
+  check_shared_value();
+  check_minus_one();
+
+  for (int r = 0; r < rounds; ++r) {
+    for (int i = 0; i < ops; ++i) {
+      entry_key_t key = 1 + rand() % key_space;
+      int tid = key % n_threads;
+
+      switch (rand() % 4) {
+      case 0:
+        bt->future_insert(key, tid);
+        model[key] = (char *)key;
+        break;
+      case 1:
+      case 2: {
+        char *ptr = upsert_value(key, rand());
+        bt->future_upsert(key, ptr, tid);
+        model[key] = ptr;
+        break;
+      }
+      default:
+        bt->future_delete(key, tid);
+        model.erase(key);
+        break;
+      }
+    }
+
+    // Buffered operations read over the tree
+    for (int i = 0; i < 8; ++i) {
+      entry_key_t min = 1 + rand() % key_space;
+      check_merged(bt, model, min, min + rand() % (key_space / 8), false);
+    }
+    check_merged(bt, model, LONG_MIN, LONG_MAX, false);
+    check_points(bt, model, key_space);
+
+    // A targeted drain, then everything applied
+    entry_key_t min = 1 + rand() % key_space;
+    check_merged(bt, model, min, min + key_space / 16, true);
+    if (r % 2 == 1) {
+      bt->future_sync_all();
+      check_tree(bt, model, LONG_MIN, LONG_MAX);
+      for (int i = 0; i < 8; ++i) {
+        min = 1 + rand() % key_space;
+        check_tree(bt, model, min, min + rand() % (key_space / 8) + 1);
+      }
+      check_points(bt, model, key_space);
+      for (int i = 0; i < 8; ++i)
+        check_short(bt, model, 1 + rand() % key_space, 1 + rand() % 16);
+    }
+  }
+
+  cout << "check: " << model.size() << " keys, " << failures << " failures"
+       << endl;
+
+  bt->future_shutdown();
+  delete bt;
+
+  return failures == 0 ? 0 : 1;
+}